@@ -25,6 +25,32 @@ extern "C" {
 #include <comm_server/ucomm_ext.h>
 }
 
+/*
+ * Reads the state page published by ucommsvr: no IPC at all.
+ * Returns false if the value is not known, so that the caller
+ * can ask the server instead.
+ */
+static bool ucommsvr_state_value(uint32_t field, int *value)
+{
+    struct ucommsvr_state state;
+
+    if (ucommsvr_read_state(&state) < 0 || !(state.valid & field))
+        return false;
+
+    switch (field) {
+    case UCOMMSVR_STATE_FOCUS:
+        *value = state.focus;
+        break;
+    case UCOMMSVR_STATE_KEYSTONE:
+        *value = state.keystone;
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
 extern "C"
 JNIEXPORT jint JNICALL
 Java_sonyxperiadev_projectorsettings_MainActivity_ucommsvrSetFocus(
@@ -49,6 +75,11 @@ Java_sonyxperiadev_projectorsettings_MainActivity_ucommsvrGetKeystone(
         JNIEnv *env,
         jobject /*this*/) {
 
+    int ksval;
+
+    if (ucommsvr_state_value(UCOMMSVR_STATE_KEYSTONE, &ksval))
+        return ksval;
+
     return ucommsvr_get_keystone();
 }
 
@@ -58,6 +89,11 @@ Java_sonyxperiadev_projectorsettings_MainActivity_ucommsvrGetFocus(
         JNIEnv *env,
         jobject /*this*/) {
 
+    int focus;
+
+    if (ucommsvr_state_value(UCOMMSVR_STATE_FOCUS, &focus))
+        return focus;
+
     return ucommsvr_get_focus();
 }
 
@@ -20,6 +20,7 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := initlight.c
 LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_STATIC_LIBRARIES := libucommproto
 LOCAL_MODULE := initlight
 LOCAL_MODULE_TAGS := optional
 #LOCAL_MODULE_RELATIVE_PATH := hw
@@ -31,6 +31,7 @@
 #include <private/android_filesystem_config.h>
 #include <utils/Log.h>
 
+#include "ucomm_proto.h"
 
 #define LOG_TAG			"InitLight"
 
@@ -44,30 +45,20 @@
 #define SERPARM_OFLAGS		(0)
 #define SERPARM_LFLAGS		(0)
 
+/* Attempts for each command, one second apart, before giving up */
+#define SENDCMD_MAX_TRIES	10
 
-				/****  VT    SO   */
-static const uint8_t std_header[] = { 0x0b, 0x0e };
+static struct ucomm_frame_decoder uart_dec;
 
-static const uint8_t cmd_init[]	  = { 0x02, 0x00, 0x02 };
-static const uint8_t cmd_unk1[]	  = { 0x02, 0x01, 0x03 };
-static const uint8_t cmd_fan_on[] = { 0x05, 0x80, 0x01,
-				      0x03, 0x7f, 0x08 };
-static const uint8_t cmd_unk3[]	= { 0x04, 0x55, 0x01,
-				    0x01, 0x5b };
-static const uint8_t cmd_led_on[] = { 0x08, 0x20, 0x04,
-				      0x00, 0x00, 0x00,
-				      0x00, 0x00, 0x2c };
-
-				/***   CR    LF    SI   */
-static const uint8_t std_footer[] = { 0x0d, 0x0a, 0x0f };
-
-int sendcmd(int fd, uint8_t cmd[], int cmd_sz)
+int sendcmd(int fd, ucomm_cmd_t id)
 {
-	int rc, sz_ans = 32;
-	char buf[40];
+	const struct ucomm_cmd_desc *desc = ucomm_cmd_get(id);
+	struct ucomm_frame frame;
+	int rc, sz_ans = 32, tries = 0;
+	uint8_t buf[40];
 
 	do {
-		write(fd, cmd, cmd_sz);
+		write(fd, desc->frame, desc->len);
 		sleep(1);
 
 		ioctl(fd, FIONREAD, &sz_ans);
@@ -78,66 +69,46 @@ int sendcmd(int fd, uint8_t cmd[], int cmd_sz)
 			sz_ans = 40;
 
 		rc = read(fd, buf, sz_ans);
-		if (buf[0] == 0x0b &&
-		    buf[1] == 0x0e)
-			return 0;
-		else
-			ALOGE("INVALID RX DATA: 0x%x 0x%x",
-				buf[0], buf[1]);
-	} while (1);
-
-	return -1;
-}
+		if (rc > 0)
+			ucomm_frame_feed(&uart_dec, buf, rc);
 
-int send_concat_cmd(int fd, const uint8_t head[],
-			const uint8_t cmd[],
-			int head_len, int cmd_len)
-{
-	int footer_len = sizeof(std_footer) / sizeof(std_footer[0]);
-	int full_sz = (head_len + cmd_len + footer_len) * sizeof(uint8_t);
-	uint8_t *full_cmd = malloc(full_sz);
+		/* Only complete frames get here, status ones checksummed */
+		while (ucomm_frame_pop(&uart_dec, &frame)) {
+			if (ucomm_cmd_reply_ok(desc, &frame))
+				return 0;
+		}
 
-	if (full_cmd == NULL) {
-		ALOGE("Memory exhausted. Cannot allocate.\n");
-		return -1;
-	}
+		ALOGE("%s: INVALID RX DATA (%u bytes dropped, %u bad csum)",
+			desc->name, uart_dec.dropped_bytes,
+			uart_dec.bad_csum);
+	} while (++tries < SENDCMD_MAX_TRIES);
 
-	memcpy(full_cmd, head, head_len);
-	memcpy(full_cmd + head_len, cmd, cmd_len);
-	memcpy(full_cmd + head_len + cmd_len, std_footer, footer_len);
+	ALOGE("%s: no valid reply after %d tries", desc->name, tries);
 
-	return sendcmd(fd, full_cmd, full_sz);
+	return -1;
 }
 
 int send_init_sequence(int fd)
 {
 	int rc;
-	int head_len = sizeof(std_header) / sizeof(std_header[0]);
-	int cmd_len;
 
-	cmd_len = sizeof(cmd_init) / sizeof(cmd_init[0]);
-	rc = send_concat_cmd(fd, std_header, cmd_init, head_len, cmd_len);
+	rc = sendcmd(fd, UCMD_INIT_HELLO);
 	if (rc)
 		goto end;
 
-	cmd_len = sizeof(cmd_unk1) / sizeof(cmd_unk1[0]);
-	rc = send_concat_cmd(fd, std_header, cmd_unk1, head_len, cmd_len);
+	rc = sendcmd(fd, UCMD_INIT_STATUS);
 	if (rc)
 		goto end;
 
-	cmd_len = sizeof(cmd_fan_on) / sizeof(cmd_fan_on[0]);
-	rc = send_concat_cmd(fd, std_header, cmd_fan_on, head_len, cmd_len);
+	rc = sendcmd(fd, UCMD_FAN_ON);
 	if (rc)
 		goto end;
 
-	cmd_len = sizeof(cmd_unk3) / sizeof(cmd_unk3[0]);
-	rc = send_concat_cmd(fd, std_header, cmd_unk3, head_len, cmd_len);
+	rc = sendcmd(fd, UCMD_INIT_UNK3);
 	if (rc)
 		goto end;
 
-	cmd_len = sizeof(cmd_led_on) / sizeof(cmd_led_on[0]);
-	rc = send_concat_cmd(fd, std_header,
-				cmd_led_on, head_len, cmd_len);
+	rc = sendcmd(fd, UCMD_INIT_LED);
 end:
 	if (rc)
 		ALOGE("ERROR: Cannot send init sequence\n");
@@ -185,6 +156,8 @@ int main(void)
 		goto end;
 	}
 
+	ucomm_frame_decoder_reset(&uart_dec);
+
 	rc = send_init_sequence(serport);
 	if (rc != 0)
 		goto end;
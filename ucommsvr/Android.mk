@@ -21,9 +21,22 @@ LOCAL_COPY_HEADERS := ./ucomm_ext.h
 include $(BUILD_COPY_HEADERS)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := ucommsvr.c ucommsvr_input.c expatparser.c
+LOCAL_SRC_FILES := ucomm_proto.c
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
+LOCAL_MODULE := libucommproto
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_OWNER := sony
+LOCAL_PROPRIETARY_MODULE := true
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := ucommsvr.c ucommsvr_input.c ucomm_queue.c ucomm_conn.c \
+    ucomm_state.c ucomm_focus_model.c \
+    expatparser.c
 LOCAL_C_INCLUDES := external/expat/lib
 LOCAL_SHARED_LIBRARIES := liblog libcutils libexpat libpolyreg
+LOCAL_STATIC_LIBRARIES := libucommproto
 LOCAL_MODULE := ucommsvr
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE_OWNER := sony
@@ -31,6 +44,16 @@ LOCAL_INIT_RC_64   := vendor/etc/init/ucommsvr.rc
 LOCAL_PROPRIETARY_MODULE := true
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := ucomm_focus_bench.c ucomm_focus_model.c expatparser.c
+LOCAL_C_INCLUDES := external/expat/lib
+LOCAL_SHARED_LIBRARIES := liblog libcutils libexpat libpolyreg
+LOCAL_MODULE := ucomm_focus_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_OWNER := sony
+LOCAL_PROPRIETARY_MODULE := true
+include $(BUILD_EXECUTABLE)
+
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := ucomm_autofocus_test.c
 LOCAL_SHARED_LIBRARIES := liblog libcutils
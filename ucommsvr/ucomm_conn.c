@@ -0,0 +1,321 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * Client connections table
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MicroCommConn"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <utils/Log.h>
+
+#include "ucomm_private.h"
+#include "ucomm_conn.h"
+
+static struct ucomm_conn conn_table[UCOMMSERVER_MAXCLIENTS];
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Looper epoll instance: tells when a full socket has room again */
+static int conn_epfd = -1;
+
+void ucomm_conn_init(int epfd)
+{
+	int i;
+
+	pthread_mutex_lock(&conn_lock);
+	conn_epfd = epfd;
+	for (i = 0; i < UCOMMSERVER_MAXCLIENTS; i++) {
+		conn_table[i].fd = -1;
+		conn_table[i].refcount = 0;
+		conn_table[i].hung_up = false;
+		conn_table[i].txq.head = 0;
+		conn_table[i].txq.count = 0;
+	}
+	pthread_mutex_unlock(&conn_lock);
+}
+
+/*
+ * ucomm_conn_add - Tracks a newly accepted client socket.
+ *
+ * \return Returns the connection, holding the looper's reference,
+ *	   or NULL if there are too many clients.
+ */
+struct ucomm_conn *ucomm_conn_add(int fd)
+{
+	struct ucomm_conn *conn = NULL;
+	int i;
+
+	pthread_mutex_lock(&conn_lock);
+	for (i = 0; i < UCOMMSERVER_MAXCLIENTS; i++) {
+		if (conn_table[i].refcount > 0)
+			continue;
+
+		conn = &conn_table[i];
+		conn->fd = fd;
+		conn->refcount = 1;
+		conn->hung_up = false;
+		conn->events = 0;
+		conn->txq.head = 0;
+		conn->txq.count = 0;
+		break;
+	}
+	pthread_mutex_unlock(&conn_lock);
+
+	return conn;
+}
+
+void ucomm_conn_get(struct ucomm_conn *conn)
+{
+	pthread_mutex_lock(&conn_lock);
+	conn->refcount++;
+	pthread_mutex_unlock(&conn_lock);
+}
+
+/* Drops a reference: the last one closes the socket */
+void ucomm_conn_put(struct ucomm_conn *conn)
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&conn_lock);
+	if (--conn->refcount == 0) {
+		fd = conn->fd;
+		conn->fd = -1;
+	}
+	pthread_mutex_unlock(&conn_lock);
+
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * ucomm_conn_hangup - The peer went away: stop talking to it and
+ *		       drop the looper's reference.
+ */
+void ucomm_conn_hangup(struct ucomm_conn *conn)
+{
+	pthread_mutex_lock(&conn_lock);
+	conn->hung_up = true;
+	pthread_mutex_unlock(&conn_lock);
+
+	ucomm_conn_put(conn);
+}
+
+/* Server shutdown: wakes up whoever is blocked on a client socket */
+void ucomm_conn_hangup_all(void)
+{
+	int i;
+
+	pthread_mutex_lock(&conn_lock);
+	for (i = 0; i < UCOMMSERVER_MAXCLIENTS; i++) {
+		if (conn_table[i].refcount == 0)
+			continue;
+
+		conn_table[i].hung_up = true;
+		shutdown(conn_table[i].fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&conn_lock);
+}
+
+/* Must be called with conn_lock held */
+static void __ucomm_conn_watch_out(struct ucomm_conn *conn, bool out)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	if (out)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = conn;
+
+	/* Harmless failure if the looper is not watching it anymore */
+	epoll_ctl(conn_epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* Must be called with conn_lock held */
+static int __ucomm_conn_xmit(struct ucomm_conn *conn,
+			     const void *buf, size_t len)
+{
+	int ret;
+
+	/* Never die of SIGPIPE because a client went away early */
+	do {
+		ret = send(conn->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+/*
+ * __ucomm_conn_queue - Keeps a message for when the client makes room
+ *			in its socket. Must be called with conn_lock held.
+ *
+ * \return Returns the queued size or -ENOBUFS if the queue is full.
+ */
+static int __ucomm_conn_queue(struct ucomm_conn *conn,
+			      const void *buf, size_t len)
+{
+	struct ucomm_conn_txq *txq = &conn->txq;
+	int slot;
+
+	if (txq->count == UCOMM_CONN_TXQ_DEPTH ||
+	    len > sizeof(union ucomm_conn_msg))
+		return -ENOBUFS;
+
+	slot = (txq->head + txq->count) % UCOMM_CONN_TXQ_DEPTH;
+	memcpy(&txq->msg[slot], buf, len);
+	txq->len[slot] = len;
+	if (txq->count++ == 0)
+		__ucomm_conn_watch_out(conn, true);
+
+	return len;
+}
+
+/* Must be called with conn_lock held */
+static int __ucomm_conn_send(struct ucomm_conn *conn,
+			     const void *buf, size_t len)
+{
+	int ret;
+
+	if (conn->hung_up)
+		return -ENOTCONN;
+
+	/* Nothing may overtake what is waiting already */
+	if (conn->txq.count > 0)
+		return __ucomm_conn_queue(conn, buf, len);
+
+	ret = __ucomm_conn_xmit(conn, buf, len);
+	if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+		return __ucomm_conn_queue(conn, buf, len);
+
+	return ret;
+}
+
+/*
+ * ucomm_conn_send - Sends one message to the client.
+ *		     Replies go out from the UART thread and from the
+ *		     looper, so this never blocks: what does not fit
+ *		     in the socket waits in the connection queue.
+ *		     Only a client that lets the queue fill up too
+ *		     gets disconnected.
+ *
+ * \return Returns the sent or queued size or negative errno.
+ */
+int ucomm_conn_send(struct ucomm_conn *conn, const void *buf, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&conn_lock);
+	ret = __ucomm_conn_send(conn, buf, len);
+	if (ret == -ENOBUFS) {
+		ALOGE("Client is not reading its replies: dropping it");
+
+		/* The looper gets a hangup and drops its reference */
+		conn->hung_up = true;
+		shutdown(conn->fd, SHUT_RDWR);
+		ret = -ENOTCONN;
+	}
+	pthread_mutex_unlock(&conn_lock);
+
+	return ret;
+}
+
+/*
+ * ucomm_conn_flush - Sends out what got queued while the client socket
+ *		      was full. Called by the looper on EPOLLOUT.
+ *
+ * \return Returns zero or negative errno if the client is gone.
+ */
+int ucomm_conn_flush(struct ucomm_conn *conn)
+{
+	struct ucomm_conn_txq *txq = &conn->txq;
+	int ret = 0;
+
+	pthread_mutex_lock(&conn_lock);
+	while (txq->count > 0) {
+		if (conn->hung_up) {
+			ret = -ENOTCONN;
+			break;
+		}
+
+		ret = __ucomm_conn_xmit(conn, &txq->msg[txq->head],
+					txq->len[txq->head]);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+			ret = 0;
+			break;
+		}
+		if (ret < 0)
+			break;
+
+		txq->head = (txq->head + 1) % UCOMM_CONN_TXQ_DEPTH;
+		txq->count--;
+		ret = 0;
+	}
+
+	if (txq->count == 0)
+		__ucomm_conn_watch_out(conn, false);
+	pthread_mutex_unlock(&conn_lock);
+
+	return ret;
+}
+
+void ucomm_conn_subscribe(struct ucomm_conn *conn, uint32_t events)
+{
+	pthread_mutex_lock(&conn_lock);
+	conn->events = events;
+	pthread_mutex_unlock(&conn_lock);
+}
+
+/*
+ * ucomm_conn_notify - Pushes an event to all the subscribed clients.
+ *		       A client that lets its queue fill up loses the
+ *		       event instead of stalling the caller.
+ */
+void ucomm_conn_notify(uint32_t event, int32_t value)
+{
+	struct micro_communicator_event evt;
+	struct timespec ts;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	memset(&evt, 0, sizeof(evt));
+	evt.tag = UCOMM_EVENT_TAG;
+	evt.event = event;
+	evt.value = value;
+	evt.stamp_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	pthread_mutex_lock(&conn_lock);
+	for (i = 0; i < UCOMMSERVER_MAXCLIENTS; i++) {
+		if (conn_table[i].refcount == 0 || conn_table[i].hung_up ||
+		    !(conn_table[i].events & event))
+			continue;
+
+		if (__ucomm_conn_send(&conn_table[i], &evt, sizeof(evt)) < 0)
+			ALOGW("Event 0x%x lost on client %d", event, i);
+	}
+	pthread_mutex_unlock(&conn_lock);
+}
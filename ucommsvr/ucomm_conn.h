@@ -0,0 +1,76 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * Client connections table
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UCOMM_CONN_H
+#define UCOMM_CONN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ucomm_private.h"
+
+/* Messages waiting for a client to make room in its socket */
+#define UCOMM_CONN_TXQ_DEPTH	32
+
+union ucomm_conn_msg {
+	int32_t results[UCOMM_BATCH_MAX_OPS];
+	struct micro_communicator_reply reply;
+	struct micro_communicator_event event;
+};
+
+struct ucomm_conn_txq {
+	union ucomm_conn_msg msg[UCOMM_CONN_TXQ_DEPTH];
+	size_t len[UCOMM_CONN_TXQ_DEPTH];
+	int head;
+	int count;
+};
+
+/*
+ * A client connection stays open across requests: the looper owns
+ * one reference for as long as the peer is connected and every job
+ * coming from it holds another one, so that the socket gets closed
+ * only after the last reply has been sent out.
+ */
+struct ucomm_conn {
+	int fd;
+	int refcount;
+	bool hung_up;
+
+	/* UCOMM_EVENT_* the client wants pushed */
+	uint32_t events;
+
+	/* Flushed by the looper when the socket becomes writable */
+	struct ucomm_conn_txq txq;
+};
+
+void ucomm_conn_init(int epfd);
+struct ucomm_conn *ucomm_conn_add(int fd);
+void ucomm_conn_get(struct ucomm_conn *conn);
+void ucomm_conn_put(struct ucomm_conn *conn);
+void ucomm_conn_hangup(struct ucomm_conn *conn);
+void ucomm_conn_hangup_all(void);
+int ucomm_conn_send(struct ucomm_conn *conn, const void *buf, size_t len);
+int ucomm_conn_flush(struct ucomm_conn *conn);
+void ucomm_conn_subscribe(struct ucomm_conn *conn, uint32_t events);
+void ucomm_conn_notify(uint32_t event, int32_t value);
+
+#endif
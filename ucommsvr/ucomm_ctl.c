@@ -18,13 +18,19 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include <private/android_filesystem_config.h>
 #include <hardware/hardware.h>
@@ -32,18 +38,364 @@
 #include <utils/Log.h>
 
 #include "ucomm_private.h"
+#include "ucomm_ext.h"
+#include "ucomm_seqlock.h"
 
-static int send_ucommsvr_data(struct micro_communicator_params params)
+/*
+ * Six seconds reply timeout, because serial communication
+ * may be slow sometimes
+ */
+#define UCOMMSVR_REPLY_TIMEOUT_MS	6000
+
+/* Give up reading the state page if a writer seems to be stuck */
+#define UCOMMSVR_STATE_READ_RETRIES	1000
+
+/* Resend once over a new connection if the server went away */
+#define UCOMMSVR_CONNECT_RETRIES	2
+
+/* How often the receiver looks for expired asynchronous requests */
+#define UCOMMSVR_RX_TICK_MS		500
+
+/* A request waiting for its reply */
+struct ucommsvr_request {
+	uint32_t tag;
+	int nresults;
+	int32_t results[UCOMM_BATCH_MAX_OPS];
+
+	/* Zero once completed, or negative errno */
+	int status;
+	bool done;
+
+	/*
+	 * Asynchronous requests live on the heap and are referenced
+	 * by the submitter and, while in flight, by the client.
+	 */
+	bool async;
+	int refcount;
+	int64_t deadline;
+	ucommsvr_complete_t complete;
+	void *data;
+	struct ucommsvr_client *client;
+
+	struct ucommsvr_request *next;
+};
+
+struct ucommsvr_client {
+	int sock;
+	bool broken;
+	uint32_t next_tag;
+
+	/* Requests sent on the current connection */
+	struct ucommsvr_request *pending;
+
+	/* Completed asynchronous requests, waiting for delivery */
+	struct ucommsvr_request *completed;
+	int evfd;
+
+	/* Server pushed events, subscribed again on every connection */
+	uint32_t events;
+	ucommsvr_event_t event_handler;
+	void *event_data;
+
+	/* Receives the replies and completes the pending requests */
+	pthread_t rx_thread;
+	bool rx_started;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool cond_ready;
+};
+
+/* Used by the one-shot functions */
+static struct ucommsvr_client default_client = {
+	.sock = -1,
+	.evfd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_once_t default_client_once = PTHREAD_ONCE_INIT;
+
+/* The client served by this receiver thread, to catch its callbacks */
+static __thread struct ucommsvr_client *rx_client;
+
+static int64_t ucommsvr_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int ucommsvr_client_cond_init(struct ucommsvr_client *client)
+{
+	pthread_condattr_t attr;
+	int rc;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	rc = pthread_cond_init(&client->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (rc)
+		return -rc;
+
+	client->cond_ready = true;
+	return 0;
+}
+
+static void default_client_init(void)
+{
+	if (ucommsvr_client_cond_init(&default_client) < 0)
+		ALOGE("Cannot initialize the client condition");
+}
+
+/* Must be called with the client lock held */
+static void __ucommsvr_request_complete(struct ucommsvr_client *client,
+					struct ucommsvr_request *req,
+					int status)
+{
+	struct ucommsvr_request **cur;
+
+	for (cur = &client->pending; *cur; cur = &(*cur)->next) {
+		if (*cur == req) {
+			*cur = req->next;
+			break;
+		}
+	}
+
+	req->next = NULL;
+	req->status = status;
+	req->done = true;
+
+	/* Callbacks run out of the lock, in the receiver thread */
+	if (req->async) {
+		uint64_t one = 1;
+
+		req->next = client->completed;
+		client->completed = req;
+		if (client->evfd >= 0 &&
+		    write(client->evfd, &one, sizeof(one)) < 0)
+			ALOGE("Cannot signal the client eventfd");
+	}
+
+	pthread_cond_broadcast(&client->cond);
+}
+
+static void ucommsvr_request_put(struct ucommsvr_request *req)
+{
+	if (__atomic_sub_fetch(&req->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(req);
+}
+
+/*
+ * __ucommsvr_client_deliver - Runs the completion callbacks of the
+ *			       asynchronous requests that are done and
+ *			       drops the client references to them.
+ *			       Called by the receiver thread with the
+ *			       client lock held, that gets released
+ *			       while the callbacks run.
+ */
+static void __ucommsvr_client_deliver(struct ucommsvr_client *client)
+{
+	struct ucommsvr_request *req, *next;
+
+	while (client->completed) {
+		req = client->completed;
+		client->completed = NULL;
+
+		pthread_mutex_unlock(&client->lock);
+		for (; req; req = next) {
+			next = req->next;
+			if (req->complete)
+				req->complete(req, req->status < 0 ?
+					req->status : req->results[0],
+					req->data);
+			ucommsvr_request_put(req);
+		}
+		pthread_mutex_lock(&client->lock);
+	}
+}
+
+/* Must be called with the client lock held */
+static void __ucommsvr_client_expire(struct ucommsvr_client *client)
+{
+	struct ucommsvr_request *req, *next;
+	int64_t now = ucommsvr_now_ms();
+
+	for (req = client->pending; req; req = next) {
+		next = req->next;
+		if (req->async && now >= req->deadline)
+			__ucommsvr_request_complete(client, req, -ETIMEDOUT);
+	}
+}
+
+/*
+ * __ucommsvr_client_disconnect - Fails the pending requests and wakes
+ *				  up the receiver, that will close the
+ *				  socket on its way out.
+ *				  Must be called with the client lock held.
+ */
+static void __ucommsvr_client_disconnect(struct ucommsvr_client *client)
+{
+	if (client->sock >= 0 && !client->broken)
+		shutdown(client->sock, SHUT_RDWR);
+	client->broken = true;
+
+	while (client->pending)
+		__ucommsvr_request_complete(client, client->pending,
+					    -ECONNRESET);
+}
+
+/*
+ * ucommsvr_client_event - Hands a server pushed event to the client
+ *			   handler. Called by the receiver thread.
+ */
+static void ucommsvr_client_event(struct ucommsvr_client *client,
+				  struct micro_communicator_event *evt)
+{
+	ucommsvr_event_t handler;
+	void *data;
+
+	pthread_mutex_lock(&client->lock);
+	handler = client->event_handler;
+	data = client->event_data;
+	if (!(client->events & evt->event))
+		handler = NULL;
+	pthread_mutex_unlock(&client->lock);
+
+	if (handler)
+		handler(evt->event, evt->value, data);
+}
+
+/*
+ * ucommsvr_client_rx - Receiver thread: matches the replies with the
+ *			pending requests by tag, until the connection
+ *			goes away.
+ */
+static void *ucommsvr_client_rx(void *data)
+{
+	struct ucommsvr_client *client = data;
+	union {
+		struct micro_communicator_reply reply;
+		struct micro_communicator_event event;
+	} msg;
+	struct ucommsvr_request *req;
+	struct pollfd pfd;
+	int ret, sock;
+
+	rx_client = client;
+
+	pthread_mutex_lock(&client->lock);
+	sock = client->sock;
+	pthread_mutex_unlock(&client->lock);
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+
+	while (1) {
+		ret = poll(&pfd, 1, UCOMMSVR_RX_TICK_MS);
+		if (ret == 0) {
+			pthread_mutex_lock(&client->lock);
+			__ucommsvr_client_expire(client);
+			__ucommsvr_client_deliver(client);
+			pthread_mutex_unlock(&client->lock);
+			continue;
+		}
+
+		ret = recv(sock, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (ret <= 0)
+			break;
+
+		if (ret == sizeof(msg.event) &&
+		    msg.event.tag == UCOMM_EVENT_TAG) {
+			ucommsvr_client_event(client, &msg.event);
+			continue;
+		}
+
+		if (ret < (int)UCOMM_REPLY_SZ(1)) {
+			ALOGE("Short reply from MicroComm Server");
+			continue;
+		}
+
+		pthread_mutex_lock(&client->lock);
+		for (req = client->pending; req; req = req->next)
+			if (req->tag == msg.reply.tag)
+				break;
+
+		/* Nobody is waiting for a timed out request */
+		if (req == NULL) {
+			__ucommsvr_client_expire(client);
+			__ucommsvr_client_deliver(client);
+			pthread_mutex_unlock(&client->lock);
+			continue;
+		}
+
+		if (ret != (int)UCOMM_REPLY_SZ(req->nresults)) {
+			ALOGE("Cannot receive reply from MicroComm Server");
+			__ucommsvr_request_complete(client, req, -EINVAL);
+		} else {
+			memcpy(req->results, msg.reply.results,
+			       sizeof(int32_t) * req->nresults);
+			__ucommsvr_request_complete(client, req, 0);
+		}
+		__ucommsvr_client_expire(client);
+		__ucommsvr_client_deliver(client);
+		pthread_mutex_unlock(&client->lock);
+	}
+
+	/* The server went away: fail whatever is still in flight */
+	pthread_mutex_lock(&client->lock);
+	if (client->sock == sock) {
+		__ucommsvr_client_disconnect(client);
+		client->sock = -1;
+	}
+	__ucommsvr_client_deliver(client);
+	pthread_mutex_unlock(&client->lock);
+
+	close(sock);
+
+	return NULL;
+}
+
+/* Must be called with the client lock held */
+static uint32_t __ucommsvr_client_tag(struct ucommsvr_client *client)
+{
+	if (client->next_tag == UCOMM_EVENT_TAG)
+		client->next_tag = 0;
+
+	return client->next_tag++;
+}
+
+/* Must be called with the client lock held */
+static int __ucommsvr_client_connect(struct ucommsvr_client *client)
 {
-	register int sock;
-	int ret, len = sizeof(struct sockaddr_un);
-	int32_t ucommsvr_reply;
-	fd_set receivefd;
 	struct sockaddr_un server_address;
-	struct timeval timeout;
+	int ret, sock;
+
+	if (client->sock >= 0 && !client->broken)
+		return 0;
+
+	/* A callback cannot wait for its own receiver to go away */
+	if (rx_client == client)
+		return -EDEADLK;
+
+	/* Reap the receiver of the previous connection */
+	if (client->rx_started) {
+		pthread_t rx_thread = client->rx_thread;
+
+		client->rx_started = false;
+		pthread_mutex_unlock(&client->lock);
+		pthread_join(rx_thread, NULL);
+		pthread_mutex_lock(&client->lock);
+
+		/* Somebody else connected in the meanwhile */
+		if (client->sock >= 0 && !client->broken)
+			return 0;
+	}
 
 	/* Get socket in the UNIX domain */
-	sock = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+	sock = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
 	if (sock < 0) {
 		ALOGE("Could not get the MicroComm Server from client");
 		return -EPROTO;
@@ -53,95 +405,641 @@ static int send_ucommsvr_data(struct micro_communicator_params params)
 	server_address.sun_family = AF_UNIX;
 	strcpy(server_address.sun_path, UCOMMSERVER_SOCKET);
 
-	/* Set nonblocking I/O for socket to avoid stall */
-	fcntl(sock, F_SETFL, O_NONBLOCK);
-
-	ret = connect(sock, (struct sockaddr*)&server_address, len);
+	ret = connect(sock, (struct sockaddr*)&server_address,
+			sizeof(struct sockaddr_un));
 	if (ret < 0) {
+		ret = -errno;
 		ALOGE("Cannot connect to MicroComm Server socket");
-		goto end;
+		close(sock);
+		return ret;
+	}
+
+	client->sock = sock;
+	client->broken = false;
+	ret = pthread_create(&client->rx_thread, NULL,
+			     ucommsvr_client_rx, client);
+	if (ret != 0) {
+		ALOGE("Cannot create the client receiver thread");
+		close(sock);
+		client->sock = -1;
+		return -ret;
+	}
+	client->rx_started = true;
+
+	/* Nobody waits for this reply: the receiver will drop it */
+	if (client->events) {
+		struct micro_communicator_tagged_params params;
+
+		params.operation = OP_SUBSCRIBE;
+		params.value = (int32_t)client->events;
+		params.tag = __ucommsvr_client_tag(client);
+		params.flags = 0;
+		if (send(sock, &params, sizeof(params), MSG_NOSIGNAL) < 0)
+			ALOGE("Cannot subscribe to the server events");
 	}
 
-	/* Send the filled struct */
-	ret = send(sock, &params, sizeof(struct micro_communicator_params), 0);
+	return 0;
+}
+
+/*
+ * __ucommsvr_client_send - Sends one tagged request on the current
+ *			    connection and adds it to the pending list.
+ *			    Must be called with the client lock held.
+ *
+ * \return Returns zero, -ECONNRESET if the connection is gone or
+ *	   negative errno.
+ */
+static int __ucommsvr_client_send(struct ucommsvr_client *client,
+				  void *msg, size_t len,
+				  struct ucommsvr_request *req)
+{
+	int ret;
+
+	ret = send(client->sock, msg, len, MSG_NOSIGNAL);
 	if (ret < 0) {
+		if (errno == EPIPE || errno == ECONNRESET ||
+		    errno == ENOTCONN)
+			return -ECONNRESET;
 		ALOGE("Cannot send data to MicroComm Server");
-		goto end;
+		return -errno;
 	}
 
-	/* Setup for receiving server reply (handle) */
-	/* Initialize and set a new FD for receive operation */
-	FD_ZERO(&receivefd);
-	FD_SET(sock, &receivefd);
+	req->done = false;
+	req->next = client->pending;
+	client->pending = req;
 
-	/*
-	 * Set a six seconds timeout for select operation 
-	 * because serial communication may be slow sometimes
-	 */
-	timeout.tv_sec = 6;
-	timeout.tv_usec = 0;
+	return 0;
+}
 
-	/* Wait until the socket is ready for receive operation */
-	ret = select(sock+1, &receivefd, NULL, NULL, &timeout);
-	if (ret < 0) {
-		ALOGE("Socket error. Cannot continue.");
-		if (ret == -1) {
-			ALOGE("Socket not ready: timed out");
-			ret = -ETIMEDOUT;
+/* Must be called with the client lock held */
+static int __ucommsvr_client_wait(struct ucommsvr_client *client,
+				  struct ucommsvr_request *req)
+{
+	struct timespec ts;
+	int rc = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += UCOMMSVR_REPLY_TIMEOUT_MS / 1000;
+	ts.tv_nsec += (UCOMMSVR_REPLY_TIMEOUT_MS % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	while (!req->done && rc != ETIMEDOUT)
+		rc = pthread_cond_timedwait(&client->cond, &client->lock, &ts);
+
+	if (!req->done) {
+		ALOGE("Socket not ready: timed out");
+		__ucommsvr_request_complete(client, req, -ETIMEDOUT);
+	}
+
+	return req->status;
+}
+
+/*
+ * ucommsvr_client_xfer - Sends one message to the MicroComm Server
+ *			  over the client's persistent connection,
+ *			  (re)connecting whenever needed, and waits
+ *			  for its reply. Other threads may have their
+ *			  own requests in flight at the same time.
+ *			  The message is sent again only if it could
+ *			  not go out on a stale connection.
+ *
+ * \param msg - Message to send: its tag gets assigned here
+ * \param tag - Where the tag lives inside the message
+ *
+ * \return Returns zero, -ECONNRESET if the connection was lost
+ *	   after sending, or negative errno.
+ */
+static int ucommsvr_client_xfer(struct ucommsvr_client *client,
+				void *msg, size_t len, uint32_t *tag,
+				struct ucommsvr_request *req)
+{
+	int ret = -ECONNRESET, retry;
+
+	if (client == NULL)
+		return -EINVAL;
+
+	if (client == &default_client)
+		pthread_once(&default_client_once, default_client_init);
+	if (!client->cond_ready)
+		return -ENOMEM;
+
+	/* Only the receiver thread could complete the request */
+	if (rx_client == client)
+		return -EDEADLK;
+
+	pthread_mutex_lock(&client->lock);
+	for (retry = 0; retry < UCOMMSVR_CONNECT_RETRIES; retry++) {
+		ret = __ucommsvr_client_connect(client);
+		if (ret < 0)
+			break;
+
+		*tag = req->tag = __ucommsvr_client_tag(client);
+		ret = __ucommsvr_client_send(client, msg, len, req);
+		if (ret == 0) {
+			/*
+			 * The server got it and may have run it already:
+			 * sending it again could move the lens twice.
+			 */
+			ret = __ucommsvr_client_wait(client, req);
+			break;
 		}
-		goto end;
+
+		if (ret != -ECONNRESET)
+			break;
+
+		/* Never went out: let the receiver notice and start over */
+		__ucommsvr_client_disconnect(client);
 	}
+	pthread_mutex_unlock(&client->lock);
 
-	/* New FD is set and the socket is ready to receive data */
-	ret = recv(sock, &ucommsvr_reply, sizeof(int32_t), 0);
-	if (ret == -1) {
-		ALOGE("Cannot receive reply from MicroComm Server");
-		ret = ucommsvr_reply = -EINVAL;
-	} else ret = ucommsvr_reply;
-end:
-	if (sock)
-		close(sock);
 	return ret;
 }
 
-static int ucommsvr_send_set(int operation, int value)
+/*
+ * ucommsvr_client_call - Sends one operation to the MicroComm Server.
+ *
+ * \return Returns the server reply or negative errno.
+ */
+static int ucommsvr_client_call(struct ucommsvr_client *client,
+				int operation, int value)
 {
-	struct micro_communicator_params params;
+	struct micro_communicator_tagged_params params;
+	struct ucommsvr_request req;
+	int ret;
 
 	params.operation = operation;
 	params.value = (int32_t)value;
+	params.flags = 0;
+	memset(&req, 0, sizeof(req));
+	req.nresults = 1;
 
-	return send_ucommsvr_data(params);
+	ret = ucommsvr_client_xfer(client, &params, sizeof(params),
+				   &params.tag, &req);
+	if (ret < 0)
+		return ret;
+
+	return req.results[0];
+}
+
+/*
+ * ucommsvr_client_open - Gets a client handle, keeping one connection
+ *			  to the MicroComm Server open across calls.
+ *			  The handle may be shared between threads, that
+ *			  can have their requests in flight at the same
+ *			  time: a long autofocus does not hold back
+ *			  the brightness adjustments.
+ *
+ * \return Returns the handle or NULL on failure.
+ */
+struct ucommsvr_client *ucommsvr_client_open(void)
+{
+	struct ucommsvr_client *client;
+
+	client = calloc(1, sizeof(*client));
+	if (client == NULL)
+		return NULL;
+
+	client->sock = -1;
+	client->evfd = -1;
+	pthread_mutex_init(&client->lock, NULL);
+	if (ucommsvr_client_cond_init(client) < 0) {
+		pthread_mutex_destroy(&client->lock);
+		free(client);
+		return NULL;
+	}
+
+	/* Not fatal: we will retry on the first request */
+	pthread_mutex_lock(&client->lock);
+	__ucommsvr_client_connect(client);
+	pthread_mutex_unlock(&client->lock);
+
+	return client;
+}
+
+/*
+ * ucommsvr_client_close - Closes the handle: asynchronous requests
+ *			   still in flight complete with -ECONNRESET.
+ *			   No other call shall be running on the
+ *			   handle and the request handles shall all
+ *			   have been released.
+ */
+void ucommsvr_client_close(struct ucommsvr_client *client)
+{
+	if (client == NULL)
+		return;
+
+	if (rx_client == client) {
+		ALOGE("Cannot close a client from its own callbacks");
+		return;
+	}
+
+	pthread_mutex_lock(&client->lock);
+	__ucommsvr_client_disconnect(client);
+	pthread_mutex_unlock(&client->lock);
+
+	if (client->rx_started)
+		pthread_join(client->rx_thread, NULL);
+
+	if (client->evfd >= 0)
+		close(client->evfd);
+
+	pthread_cond_destroy(&client->cond);
+	pthread_mutex_destroy(&client->lock);
+	free(client);
+}
+
+int ucommsvr_client_set_backlight(struct ucommsvr_client *client,
+				  int brightness)
+{
+	return ucommsvr_client_call(client, OP_BRIGHTNESS, brightness);
+}
+
+int ucommsvr_client_set_keystone(struct ucommsvr_client *client, int ksval)
+{
+	return ucommsvr_client_call(client, OP_KEYSTONE_SET, ksval);
+}
+
+int ucommsvr_client_set_focus(struct ucommsvr_client *client, int focus)
+{
+	return ucommsvr_client_call(client, OP_FOCUS_SET, focus);
+}
+
+int ucommsvr_client_do_autofocus(struct ucommsvr_client *client)
+{
+	return ucommsvr_client_call(client, OP_AUTOFOCUS, 0);
+}
+
+/* Lets the server keep the image in focus while the projector moves */
+int ucommsvr_client_set_cont_af(struct ucommsvr_client *client, int enable)
+{
+	return ucommsvr_client_call(client, OP_CONT_AF_SET, !!enable);
+}
+
+int ucommsvr_client_get_keystone(struct ucommsvr_client *client)
+{
+	return ucommsvr_client_call(client, OP_KEYSTONE_GET, UCOMM_GET_CACHED);
+}
+
+int ucommsvr_client_get_focus(struct ucommsvr_client *client)
+{
+	return ucommsvr_client_call(client, OP_FOCUS_GET, UCOMM_GET_CACHED);
+}
+
+/* Asks the server to query the uC if its value is older than that */
+int ucommsvr_client_get_focus_maxage(struct ucommsvr_client *client,
+				     int max_age_ms)
+{
+	return ucommsvr_client_call(client, OP_FOCUS_GET, max_age_ms);
+}
+
+int ucommsvr_client_get_backlight(struct ucommsvr_client *client)
+{
+	return ucommsvr_client_call(client, OP_BRIGHTNESS_GET,
+				    UCOMM_GET_CACHED);
+}
+
+/*
+ * ucommsvr_client_batch - Sends a list of operations in one message:
+ *			   the server executes them in order.
+ *			   With UCOMM_BATCH_STOP_ON_ERROR, the operations
+ *			   following a failed one are not executed and
+ *			   get -ECANCELED.
+ *
+ * \param results - Per-operation server replies, count entries
+ *
+ * \return Returns zero or negative errno if the batch was not carried
+ *	   out at all.
+ */
+int ucommsvr_client_batch(struct ucommsvr_client *client,
+			  const struct ucommsvr_batch_op *ops, int count,
+			  unsigned int flags, int *results)
+{
+	struct micro_communicator_batch batch;
+	struct ucommsvr_request req;
+	int i, ret;
+
+	if (ops == NULL || results == NULL ||
+	    count <= 0 || count > UCOMM_BATCH_MAX_OPS)
+		return -EINVAL;
+
+	memset(&batch, 0, UCOMM_BATCH_HDR_SZ);
+	batch.operation = OP_BATCH;
+	batch.count = count;
+	batch.flags = (flags & ~UCOMM_BATCH_TAGGED) | UCOMM_BATCH_TAGGED;
+	for (i = 0; i < count; i++) {
+		batch.ops[i].operation = ops[i].operation;
+		batch.ops[i].value = (int32_t)ops[i].value;
+	}
+	memset(&req, 0, sizeof(req));
+	req.nresults = count;
+
+	ret = ucommsvr_client_xfer(client, &batch, UCOMM_BATCH_SZ(count),
+				   &batch.tag, &req);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < count; i++)
+		results[i] = req.results[i];
+
+	return 0;
+}
+
+/*
+ * ucommsvr_client_submit - Sends one operation to the MicroComm Server
+ *			    without waiting for its reply.
+ *			    On completion, the callback, if any, runs in
+ *			    the client receiver thread and the client
+ *			    eventfd, if any, becomes readable.
+ *			    Submitting from a callback works as long as
+ *			    the connection is up: it fails with -EDEADLK
+ *			    when a reconnection would be needed.
+ *
+ * \param complete - Completion callback, may be NULL
+ * \param data - Opaque pointer passed to the callback
+ * \param out - Request handle, to be released with
+ *	        ucommsvr_request_release(); may be NULL for
+ *	        fire-and-forget requests
+ *
+ * \return Returns zero or negative errno, in which case the
+ *	   callback is never called.
+ */
+int ucommsvr_client_submit(struct ucommsvr_client *client,
+			   int operation, int value,
+			   ucommsvr_complete_t complete, void *data,
+			   struct ucommsvr_request **out)
+{
+	struct micro_communicator_tagged_params params;
+	struct ucommsvr_request *req;
+	int ret;
+
+	if (client == NULL || !client->cond_ready)
+		return -EINVAL;
+
+	req = calloc(1, sizeof(*req));
+	if (req == NULL)
+		return -ENOMEM;
+
+	req->async = true;
+	req->refcount = out ? 2 : 1;
+	req->nresults = 1;
+	req->complete = complete;
+	req->data = data;
+	req->client = client;
+
+	params.operation = operation;
+	params.value = (int32_t)value;
+	params.flags = 0;
+
+	pthread_mutex_lock(&client->lock);
+	ret = __ucommsvr_client_connect(client);
+	if (ret == 0) {
+		params.tag = req->tag = __ucommsvr_client_tag(client);
+		req->deadline = ucommsvr_now_ms() + UCOMMSVR_REPLY_TIMEOUT_MS;
+		ret = __ucommsvr_client_send(client, &params,
+					     sizeof(params), req);
+		if (ret == -ECONNRESET)
+			__ucommsvr_client_disconnect(client);
+	}
+	pthread_mutex_unlock(&client->lock);
+
+	if (ret < 0) {
+		free(req);
+		return ret;
+	}
+
+	if (out)
+		*out = req;
+
+	return 0;
+}
+
+/*
+ * ucommsvr_client_subscribe - Asks the server to push the specified
+ *			       UCOMM_EVENT_* as they happen, instead of
+ *			       having to poll for the projector state.
+ *			       The handler runs in the client receiver
+ *			       thread. Zero events unsubscribes.
+ *
+ * \return Returns zero or negative errno.
+ */
+int ucommsvr_client_subscribe(struct ucommsvr_client *client,
+			      unsigned int events,
+			      ucommsvr_event_t handler, void *data)
+{
+	if (client == NULL || (events && handler == NULL))
+		return -EINVAL;
+
+	pthread_mutex_lock(&client->lock);
+	client->events = events;
+	client->event_handler = handler;
+	client->event_data = data;
+	pthread_mutex_unlock(&client->lock);
+
+	return ucommsvr_client_call(client, OP_SUBSCRIBE, (int)events);
+}
+
+/*
+ * ucommsvr_client_eventfd - Gets an eventfd that becomes readable
+ *			     whenever an asynchronous request of this
+ *			     client completes, to be used in the
+ *			     caller's own event loop. The handle keeps
+ *			     its ownership.
+ *
+ * \return Returns the eventfd or negative errno.
+ */
+int ucommsvr_client_eventfd(struct ucommsvr_client *client)
+{
+	int ret;
+
+	if (client == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&client->lock);
+	if (client->evfd < 0) {
+		client->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (client->evfd < 0)
+			ALOGE("Cannot create the client eventfd");
+	}
+	ret = client->evfd >= 0 ? client->evfd : -errno;
+	pthread_mutex_unlock(&client->lock);
+
+	return ret;
+}
+
+/*
+ * ucommsvr_request_result - Checks an asynchronous request.
+ *
+ * \param result - Server reply or negative errno, once completed
+ *
+ * \return Returns zero if completed or -EINPROGRESS.
+ */
+int ucommsvr_request_result(struct ucommsvr_request *req, int *result)
+{
+	struct ucommsvr_client *client;
+	int ret = -EINPROGRESS;
+
+	if (req == NULL || result == NULL)
+		return -EINVAL;
+
+	client = req->client;
+	pthread_mutex_lock(&client->lock);
+	if (req->done) {
+		*result = req->status < 0 ? req->status : req->results[0];
+		ret = 0;
+	}
+	pthread_mutex_unlock(&client->lock);
+
+	return ret;
+}
+
+/*
+ * ucommsvr_request_release - Drops the submitter's reference to an
+ *			      asynchronous request. The request may
+ *			      still be in flight: its callback will
+ *			      run nevertheless.
+ */
+void ucommsvr_request_release(struct ucommsvr_request *req)
+{
+	if (req != NULL)
+		ucommsvr_request_put(req);
+}
+
+static const struct ucomm_state_page *state_page;
+static pthread_mutex_t state_page_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The server may not be up yet: try again on the next read */
+static const struct ucomm_state_page *ucommsvr_state_page_get(void)
+{
+	const struct ucomm_state_page *page;
+	void *map;
+	int fd;
+
+	page = __atomic_load_n(&state_page, __ATOMIC_ACQUIRE);
+	if (page != NULL)
+		return page;
+
+	pthread_mutex_lock(&state_page_lock);
+	if (state_page != NULL)
+		goto end;
+
+	fd = open(UCOMMSERVER_STATE_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto end;
+
+	map = mmap(NULL, sizeof(struct ucomm_state_page), PROT_READ,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ALOGE("Cannot map the MicroComm Server state page");
+		goto end;
+	}
+
+	__atomic_store_n(&state_page, map, __ATOMIC_RELEASE);
+end:
+	page = state_page;
+	pthread_mutex_unlock(&state_page_lock);
+
+	return page;
 }
 
+/*
+ * ucommsvr_read_state - Reads the projector state published by the
+ *			 server, with no IPC: cheap enough to be
+ *			 polled at display refresh rate.
+ *
+ * \return Returns zero, -ENODEV if the state page is not available
+ *	   or -EAGAIN if no consistent snapshot could be taken.
+ */
+int ucommsvr_read_state(struct ucommsvr_state *state)
+{
+	const struct ucomm_state_page *page;
+	uint32_t seq;
+	int retry = 0;
+
+	if (state == NULL)
+		return -EINVAL;
+
+	page = ucommsvr_state_page_get();
+	if (page == NULL)
+		return -ENODEV;
+
+	if (page->magic != UCOMM_STATE_PAGE_MAGIC ||
+	    page->version != UCOMM_STATE_PAGE_VERSION)
+		return -ENODEV;
+
+	do {
+		if (retry++ >= UCOMMSVR_STATE_READ_RETRIES)
+			return -EAGAIN;
+
+		seq = ucomm_seqlock_read_begin(&page->seq);
+		state->valid = page->valid;
+		state->brightness = page->brightness;
+		state->focus = page->focus;
+		state->keystone = page->keystone;
+		state->far_max = page->far_max;
+		state->near_max = page->near_max;
+		state->tof_range_mm = page->tof_range_mm;
+		state->tof_status = page->tof_status;
+		state->tof_stamp_ms = page->tof_stamp_ms;
+		state->stamp_ms = page->stamp_ms;
+	} while (ucomm_seqlock_read_retry(&page->seq, seq));
+
+	state->seq = seq;
+	return 0;
+}
+
+/* One-shot functions, sharing the process-wide connection */
 int ucommsvr_set_backlight(int brightness)
 {
-	return ucommsvr_send_set(OP_BRIGHTNESS, brightness);
+	return ucommsvr_client_set_backlight(&default_client, brightness);
 }
 
 int ucommsvr_set_keystone(int ksval)
 {
-	return ucommsvr_send_set(OP_KEYSTONE_SET, ksval);
+	return ucommsvr_client_set_keystone(&default_client, ksval);
 }
 
 int ucommsvr_set_focus(int focus)
 {
-	return ucommsvr_send_set(OP_FOCUS_SET, focus);
+	return ucommsvr_client_set_focus(&default_client, focus);
 }
 
 int ucommsvr_do_autofocus(void)
 {
-	return ucommsvr_send_set(OP_AUTOFOCUS, 0);
+	return ucommsvr_client_do_autofocus(&default_client);
+}
+
+int ucommsvr_set_cont_af(int enable)
+{
+	return ucommsvr_client_set_cont_af(&default_client, enable);
 }
 
 int ucommsvr_get_keystone(void)
 {
-	return ucommsvr_send_set(OP_KEYSTONE_GET, 0);
+	return ucommsvr_client_get_keystone(&default_client);
 }
 
 int ucommsvr_get_focus(void)
 {
-	return ucommsvr_send_set(OP_FOCUS_GET, 0);
+	return ucommsvr_client_get_focus(&default_client);
 }
 
+int ucommsvr_get_focus_maxage(int max_age_ms)
+{
+	return ucommsvr_client_get_focus_maxage(&default_client, max_age_ms);
+}
 
+int ucommsvr_get_backlight(void)
+{
+	return ucommsvr_client_get_backlight(&default_client);
+}
+
+int ucommsvr_batch(const struct ucommsvr_batch_op *ops, int count,
+		   unsigned int flags, int *results)
+{
+	return ucommsvr_client_batch(&default_client, ops, count,
+				     flags, results);
+}
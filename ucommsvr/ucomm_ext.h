@@ -20,17 +20,148 @@
 #ifndef UCOMM_EXT_H
 #define UCOMM_EXT_H
 
+#include <stdint.h>
+
+/* MicroComm Server operations */
+typedef enum {
+	OP_INITIALIZE = 0,
+	OP_POWER,
+	OP_BRIGHTNESS,
+	OP_FOCUS_SET,
+	OP_KEYSTONE_SET,
+	OP_FOCUS_GET,
+	OP_KEYSTONE_GET,
+	OP_AUTOFOCUS,
+	OP_CONT_AF_SET,
+	OP_BATCH,
+	OP_BRIGHTNESS_GET,
+	OP_SUBSCRIBE,
+	OP_MAX,
+} ucomm_svr_ops_t;
+
 #define UCOMM_FOCUS_TEST_FAR		0xF0CA1
 #define UCOMM_FOCUS_TEST_NEAR		0xF0CA0
 
 #define ERR_UCOMM_FOCUS_UNDERFLOW	-6
 #define ERR_UCOMM_FOCUS_OVERFLOW	-7
 #define ERR_UCOMM_FOCUS_GENERAL		-8
+#define ERR_UCOMM_SUPERSEDED		-9
+
+/*
+ * Getters take the maximum age, in milliseconds, of the value the
+ * server may answer with, instead of querying the uC: zero accepts
+ * any known value, UCOMM_GET_FRESH always queries the uC.
+ */
+#define UCOMM_GET_CACHED		0
+#define UCOMM_GET_FRESH			-1
+
+#define UCOMM_BATCH_MAX_OPS		16
+
+/* Batch flags */
+#define UCOMM_BATCH_STOP_ON_ERROR	(1 << 0)
+
+struct ucommsvr_batch_op {
+	int operation;
+	int value;
+};
+
+/*
+ * Events pushed by the server to the connections that subscribed
+ * to them with OP_SUBSCRIBE, whose value is the events mask.
+ */
+#define UCOMM_EVENT_FOCUS_DONE		(1 << 0)	/* value: position */
+#define UCOMM_EVENT_FOCUS_FAILED	(1 << 1)	/* value: error */
+#define UCOMM_EVENT_BRIGHTNESS		(1 << 2)	/* value: 0 if off */
+#define UCOMM_EVENT_KEYSTONE		(1 << 3)
+#define UCOMM_EVENT_UC_ERROR		(1 << 4)	/* value: ERR_UCOMM_* */
+#define UCOMM_EVENT_ALL			0x1f
+
+/* Projector state, as published by the server */
+#define UCOMMSVR_STATE_BRIGHTNESS	(1 << 0)
+#define UCOMMSVR_STATE_FOCUS		(1 << 1)
+#define UCOMMSVR_STATE_KEYSTONE		(1 << 2)
+#define UCOMMSVR_STATE_FOCUS_RANGE	(1 << 3)
+#define UCOMMSVR_STATE_TOF		(1 << 4)
+
+struct ucommsvr_state {
+	/* Changes on every update */
+	uint32_t seq;
+
+	/* UCOMMSVR_STATE_* bits of the fields holding a known value */
+	uint32_t valid;
+
+	int brightness;
+	int focus;
+	int keystone;
+	int far_max;
+	int near_max;
+	int tof_range_mm;
+	int tof_status;
+
+	/* CLOCK_MONOTONIC milliseconds */
+	int64_t tof_stamp_ms;
+	int64_t stamp_ms;
+};
+
+int ucommsvr_read_state(struct ucommsvr_state *state);
+
+/* Persistent connection, may be shared between threads */
+struct ucommsvr_client;
+
+/* Asynchronous request, see ucommsvr_client_submit() */
+struct ucommsvr_request;
+
+/*
+ * Callbacks run in the client receiver thread: they may submit more
+ * requests, but blocking calls on the same client fail with -EDEADLK.
+ */
+
+/* Gets the server reply or negative errno */
+typedef void (*ucommsvr_complete_t)(struct ucommsvr_request *req,
+				    int result, void *data);
+
+/* Gets one UCOMM_EVENT_* */
+typedef void (*ucommsvr_event_t)(unsigned int event, int value,
+				 void *data);
+
+struct ucommsvr_client *ucommsvr_client_open(void);
+void ucommsvr_client_close(struct ucommsvr_client *client);
+int ucommsvr_client_set_backlight(struct ucommsvr_client *client,
+				  int brightness);
+int ucommsvr_client_set_keystone(struct ucommsvr_client *client, int ksval);
+int ucommsvr_client_set_focus(struct ucommsvr_client *client, int focus);
+int ucommsvr_client_do_autofocus(struct ucommsvr_client *client);
+int ucommsvr_client_set_cont_af(struct ucommsvr_client *client, int enable);
+int ucommsvr_client_get_focus(struct ucommsvr_client *client);
+int ucommsvr_client_get_keystone(struct ucommsvr_client *client);
+int ucommsvr_client_get_focus_maxage(struct ucommsvr_client *client,
+				     int max_age_ms);
+int ucommsvr_client_get_backlight(struct ucommsvr_client *client);
+int ucommsvr_client_batch(struct ucommsvr_client *client,
+			  const struct ucommsvr_batch_op *ops, int count,
+			  unsigned int flags, int *results);
+
+int ucommsvr_client_submit(struct ucommsvr_client *client,
+			   int operation, int value,
+			   ucommsvr_complete_t complete, void *data,
+			   struct ucommsvr_request **out);
+int ucommsvr_client_eventfd(struct ucommsvr_client *client);
+int ucommsvr_client_subscribe(struct ucommsvr_client *client,
+			      unsigned int events,
+			      ucommsvr_event_t handler, void *data);
+int ucommsvr_request_result(struct ucommsvr_request *req, int *result);
+void ucommsvr_request_release(struct ucommsvr_request *req);
 
+/* One-shot calls, over a process-wide connection */
 int ucommsvr_set_backlight(int brightness);
 int ucommsvr_set_keystone(int ksval);
 int ucommsvr_set_focus(int focus);
+int ucommsvr_set_cont_af(int enable);
 int ucommsvr_get_focus(void);
 int ucommsvr_get_keystone(void);
+int ucommsvr_get_focus_maxage(int max_age_ms);
+int ucommsvr_get_backlight(void);
+int ucommsvr_batch(const struct ucommsvr_batch_op *ops, int count,
+		   unsigned int flags, int *results);
 
 #endif
@@ -0,0 +1,143 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * Focus model evaluators benchmark
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MicroCommFocusBench"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <utils/Log.h>
+#include <libpolyreg/polyreg.h>
+
+#include "ucomm_private.h"
+#include "ucomm_focus_model.h"
+
+#define BENCH_DEF_ROUNDS	200
+
+static struct micro_communicator_focus_params focus_conf;
+
+static int64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Same fit as ucomm_autofocus_get_coeff() in the server */
+static int bench_load_coeff(char *path)
+{
+	struct pair_data *pairs;
+	unsigned int i;
+	int rc;
+
+	rc = parse_ucomm_xml_data(path, "tof_focus", &focus_conf);
+	if (rc < 0 || focus_conf.table == NULL || focus_conf.num_steps < 2)
+		return -1;
+
+	pairs = calloc(focus_conf.num_steps, sizeof(*pairs));
+	focus_conf.terms = calloc(3 * FOCTBL_POLYREG_DEGREE, sizeof(double));
+	if (pairs == NULL || focus_conf.terms == NULL)
+		return -1;
+
+	for (i = 0; i < focus_conf.num_steps; i++) {
+		pairs[i].x = focus_conf.table[i].input_val;
+		pairs[i].y = focus_conf.table[i].focus_step;
+	}
+
+	compute_coefficients(pairs, focus_conf.num_steps,
+				FOCTBL_POLYREG_DEGREE, focus_conf.terms);
+	free(pairs);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct ucomm_focus_fixed fx = { 0 };
+	int64_t start, t_poly, t_fixed = 0, t_lut;
+	volatile int sink = 0;
+	int rounds = BENCH_DEF_ROUNDS;
+	int mm, r, n, step, rc;
+
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+
+	if (bench_load_coeff(argc > 1 ? argv[1] : UCOMMSERVER_CONF_FILE)) {
+		fprintf(stderr, "Cannot load the focus calibration\n");
+		return 1;
+	}
+
+	rc = ucomm_focus_fixed_init(&fx, focus_conf.terms,
+				    FOCTBL_POLYREG_DEGREE);
+	if (rc == -EINVAL) {
+		fprintf(stderr, "Calibration unusable for fixed point\n");
+		return 1;
+	}
+	printf("Fixed point max error: %d steps (%s)\n", fx.max_err,
+		rc < 0 ? "rejected" : "accepted");
+
+	rc = ucomm_focus_model_build(focus_conf.terms, FOCTBL_POLYREG_DEGREE);
+	if (rc < 0) {
+		fprintf(stderr, "Cannot build the focus table\n");
+		return 1;
+	}
+
+	n = FOCUS_LUT_ENTRIES * rounds;
+
+	start = bench_now_ns();
+	for (r = 0; r < rounds; r++)
+		for (mm = 0; mm <= FOCUS_LUT_MAX_MM; mm++)
+			sink += ucomm_focus_to_step(polyreg_f(mm,
+					focus_conf.terms, FOCTBL_POLYREG_DEGREE));
+	t_poly = bench_now_ns() - start;
+
+	/* Terms that do not fit leave the evaluator half set up */
+	if (fx.valid) {
+		start = bench_now_ns();
+		for (r = 0; r < rounds; r++)
+			for (mm = 0; mm <= FOCUS_LUT_MAX_MM; mm++)
+				sink += ucomm_focus_fixed_eval(&fx, mm);
+		t_fixed = bench_now_ns() - start;
+	}
+
+	start = bench_now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (mm = 0; mm <= FOCUS_LUT_MAX_MM; mm++) {
+			ucomm_focus_model_step(mm, &step);
+			sink += step;
+		}
+	}
+	t_lut = bench_now_ns() - start;
+
+	printf("%d evaluations each\n", n);
+	printf("polyreg_f:   %8.2f ns/eval\n", (double)t_poly / n);
+	if (fx.valid)
+		printf("fixed point: %8.2f ns/eval\n", (double)t_fixed / n);
+	else
+		printf("fixed point: skipped\n");
+	printf("table:       %8.2f ns/eval\n", (double)t_lut / n);
+
+	return 0;
+}
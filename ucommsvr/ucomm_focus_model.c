@@ -0,0 +1,283 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * ToF range to focus step model
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MicroCommFocus"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <utils/Log.h>
+#include <libpolyreg/polyreg.h>
+
+#include "ucomm_focus_model.h"
+
+/* Points evaluated at once: a few vector registers worth per term */
+#define FOCUS_EVAL_CHUNK		256
+
+/*
+ * Largest sum of the rescaled terms, in steps: bounds every Horner
+ * value, as u < 1, so that a Q24 value times a range below 2^14mm
+ * always fits in 63 bits.
+ */
+#define FOCUS_FIXED_MAX_SUM		(1LL << 24)
+
+/*
+ * Focus step for every millimeter of the valid ToF range, computed
+ * once out of the calibration polynomial, so that converting a range
+ * is a plain array access. Built at startup, read-only afterwards.
+ */
+static int16_t *focus_lut;
+
+/*
+ * ucomm_focus_poly_eval - Evaluates the calibration polynomial on many
+ *			   points, with the Horner scheme.
+ *			   The terms are in ascending degree order.
+ *
+ * Every term is applied to a whole chunk of points before the next
+ * one, so that the inner loop has no dependencies between iterations
+ * and gets vectorized by the compiler.
+ */
+void ucomm_focus_poly_eval(const double *terms, int degree,
+			   const double *restrict x, double *restrict y, int n)
+{
+	int i, j, k, len;
+
+	for (i = 0; i < n; i += FOCUS_EVAL_CHUNK) {
+		len = n - i < FOCUS_EVAL_CHUNK ? n - i : FOCUS_EVAL_CHUNK;
+
+		for (j = 0; j < len; j++)
+			y[i + j] = terms[degree];
+
+		for (k = degree - 1; k >= 0; k--) {
+			const double t = terms[k];
+
+			for (j = 0; j < len; j++)
+				y[i + j] = y[i + j] * x[i + j] + t;
+		}
+	}
+}
+
+/*
+ * ucomm_focus_to_step - Converts a polynomial value to a focus step.
+ *			 Truncates, like autofocus always did with the
+ *			 libpolyreg result, so that every evaluator
+ *			 lands on the very same step.
+ */
+int ucomm_focus_to_step(double y)
+{
+	if (y >= INT16_MAX)
+		return INT16_MAX;
+	if (y <= INT16_MIN)
+		return INT16_MIN;
+
+	return (int)y;
+}
+
+/*
+ * ucomm_focus_model_fixup - Compares the table with what libpolyreg
+ *			     computes for the same terms, taking the
+ *			     libpolyreg step wherever they disagree.
+ *
+ * \return Returns the number of entries fixed up.
+ */
+static int ucomm_focus_model_fixup(int16_t *lut, double *terms, int degree)
+{
+	int i, ref, fixed = 0;
+
+	for (i = 0; i < FOCUS_LUT_ENTRIES; i++) {
+		ref = ucomm_focus_to_step(polyreg_f(i, terms, degree));
+		if (lut[i] != ref) {
+			lut[i] = ref;
+			fixed++;
+		}
+	}
+
+	return fixed;
+}
+
+/*
+ * ucomm_focus_model_build - Builds the range to focus step table out of
+ *			     the calibration polynomial. Beyond the
+ *			     calibrated ranges, the table follows the
+ *			     polynomial like autofocus always did.
+ *
+ * \return Returns zero or negative errno.
+ */
+int ucomm_focus_model_build(double *terms, int degree)
+{
+	double *x, *y;
+	int16_t *lut;
+	int i, fixed, rc = 0;
+
+	if (terms == NULL || degree < 0)
+		return -EINVAL;
+
+	lut = calloc(FOCUS_LUT_ENTRIES, sizeof(*lut));
+	x = calloc(FOCUS_LUT_ENTRIES, sizeof(*x));
+	y = calloc(FOCUS_LUT_ENTRIES, sizeof(*y));
+	if (lut == NULL || x == NULL || y == NULL) {
+		ALOGE("Memory exhausted. Cannot build the focus table");
+		free(lut);
+		rc = -ENOMEM;
+		goto end;
+	}
+
+	for (i = 0; i < FOCUS_LUT_ENTRIES; i++)
+		x[i] = i;
+
+	ucomm_focus_poly_eval(terms, degree, x, y, FOCUS_LUT_ENTRIES);
+
+	for (i = 0; i < FOCUS_LUT_ENTRIES; i++)
+		lut[i] = ucomm_focus_to_step(y[i]);
+
+	/*
+	 * libpolyreg is the reference: rounding differences may move a
+	 * value sitting right on a step boundary to the next step.
+	 */
+	fixed = ucomm_focus_model_fixup(lut, terms, degree);
+	if (fixed)
+		ALOGD("Focus table: %d entries fixed up", fixed);
+
+	free(focus_lut);
+	focus_lut = lut;
+
+	ALOGI("Focus table built: %d entries", FOCUS_LUT_ENTRIES);
+end:
+	free(x);
+	free(y);
+
+	return rc;
+}
+
+/*
+ * ucomm_focus_model_step - Gets the focus step for a ToF range.
+ *			    Ranges get clamped to the valid ToF range.
+ *
+ * \return Returns zero or -ENODATA if there is no table.
+ */
+int ucomm_focus_model_step(int range_mm, int *step)
+{
+	if (focus_lut == NULL)
+		return -ENODATA;
+
+	if (range_mm < 0)
+		range_mm = 0;
+	else if (range_mm > FOCUS_LUT_MAX_MM)
+		range_mm = FOCUS_LUT_MAX_MM;
+
+	*step = focus_lut[range_mm];
+
+	return 0;
+}
+
+/*
+ * ucomm_focus_fixed_eval - Evaluates the calibration polynomial with
+ *			    integer arithmetic only, using the Horner
+ *			    scheme on the rescaled terms.
+ *			    Ranges get clamped to the valid ToF range.
+ *
+ * \return Returns the focus step.
+ */
+int ucomm_focus_fixed_eval(const struct ucomm_focus_fixed *fx,
+			   int range_mm)
+{
+	int64_t acc;
+	int k;
+
+	if (range_mm < 0)
+		range_mm = 0;
+	else if (range_mm > FOCUS_LUT_MAX_MM)
+		range_mm = FOCUS_LUT_MAX_MM;
+
+	acc = fx->c[fx->degree];
+	for (k = fx->degree - 1; k >= 0; k--)
+		acc = ((acc * range_mm) >> FOCUS_FIXED_XSHIFT) + fx->c[k];
+
+	/* Truncate toward zero, as ucomm_focus_to_step() does */
+	if (acc < 0)
+		acc = -((-acc) >> FOCUS_FIXED_SHIFT);
+	else
+		acc >>= FOCUS_FIXED_SHIFT;
+
+	if (acc > INT16_MAX)
+		return INT16_MAX;
+	if (acc < INT16_MIN)
+		return INT16_MIN;
+
+	return (int)acc;
+}
+
+/*
+ * ucomm_focus_fixed_init - Prepares the fixed point evaluator and
+ *			    checks it against libpolyreg on every
+ *			    millimeter of the valid ToF range.
+ *
+ * \param terms - Calibration polynomial terms, ascending degree order
+ *
+ * \return Returns zero if it gives the libpolyreg step everywhere,
+ *	   -ERANGE if the terms do not fit or it does not, or -EINVAL.
+ */
+int ucomm_focus_fixed_init(struct ucomm_focus_fixed *fx, double *terms,
+			   int degree)
+{
+	double scale = 1.0, term, sum = 0;
+	int k, mm, diff;
+
+	fx->valid = false;
+	fx->max_err = 0;
+
+	if (terms == NULL || degree < 0 || degree > FOCUS_FIXED_MAX_DEGREE)
+		return -EINVAL;
+
+	fx->degree = degree;
+
+	for (k = 0; k <= degree; k++) {
+		term = terms[k] * scale;
+		sum += term >= 0 ? term : -term;
+		if (sum >= FOCUS_FIXED_MAX_SUM) {
+			ALOGW("Focus term %d does not fit fixed point", k);
+			return -ERANGE;
+		}
+
+		term *= 1 << FOCUS_FIXED_SHIFT;
+		fx->c[k] = (int64_t)(term >= 0 ? term + 0.5 : term - 0.5);
+		scale *= 1 << FOCUS_FIXED_XSHIFT;
+	}
+
+	for (mm = 0; mm <= FOCUS_LUT_MAX_MM; mm++) {
+		diff = ucomm_focus_fixed_eval(fx, mm) -
+			ucomm_focus_to_step(polyreg_f(mm, terms, degree));
+		if (diff < 0)
+			diff = -diff;
+		if (diff > fx->max_err)
+			fx->max_err = diff;
+	}
+
+	if (fx->max_err) {
+		ALOGW("Fixed point focus off by %d steps", fx->max_err);
+		return -ERANGE;
+	}
+
+	fx->valid = true;
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * ToF range to focus step model
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UCOMM_FOCUS_MODEL_H
+#define UCOMM_FOCUS_MODEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Valid ToF range, as filtered by the ToF input module */
+#define FOCUS_LUT_MAX_MM		9000
+#define FOCUS_LUT_ENTRIES		(FOCUS_LUT_MAX_MM + 1)
+
+/*
+ * Fixed point evaluator: values in Q24, ranges taken as fractions
+ * of 2^14mm, which are exact as FOCUS_LUT_MAX_MM is below that.
+ */
+#define FOCUS_FIXED_SHIFT		24
+#define FOCUS_FIXED_XSHIFT		14
+#define FOCUS_FIXED_MAX_DEGREE		8
+
+/*
+ * Calibration polynomial rescaled on [0, 2^14mm], for evaluation with
+ * integer arithmetic only: the range becomes u = range_mm / 2^14,
+ * so that every term stays within a few orders of magnitude.
+ */
+struct ucomm_focus_fixed {
+	bool valid;
+	int degree;
+
+	/* Rescaled terms, Q24, ascending degree order */
+	int64_t c[FOCUS_FIXED_MAX_DEGREE + 1];
+
+	/* Largest error against libpolyreg seen when checking, in steps */
+	int max_err;
+};
+
+void ucomm_focus_poly_eval(const double *terms, int degree,
+			   const double *restrict x, double *restrict y, int n);
+int ucomm_focus_to_step(double y);
+int ucomm_focus_model_build(double *terms, int degree);
+int ucomm_focus_model_step(int range_mm, int *step);
+
+int ucomm_focus_fixed_init(struct ucomm_focus_fixed *fx, double *terms,
+			   int degree);
+int ucomm_focus_fixed_eval(const struct ucomm_focus_fixed *fx,
+			   int range_mm);
+
+#endif
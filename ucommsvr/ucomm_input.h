@@ -23,27 +23,79 @@
 #define TOF_STABILIZATION_WAIT_MS		10
 #define TOF_STABILIZATION_HYST_MM		7
 #define TOF_STABILIZATION_MATCH_NO		3
+#define TOF_STABILIZATION_WINDOW_MS		500
+
+/* Number of the latest ToF samples kept by the ToF thread */
+#define TOF_RING_SIZE				16
+
+#define TOF_ESTIMATE_SAMPLES			8
+#define TOF_ESTIMATE_MIN_CONFIDENCE		50
+#define TOF_ESTIMATE_TIMEOUT_MS			200
+
+/* Weight of a sample in the estimate, by range status */
+#define TOF_WEIGHT_VALID			4
+#define TOF_WEIGHT_INVALID			1
+
+/*
+ * Range tracker tuning: measurement noise, by range status, in mm^2,
+ * acceleration noise in (mm/s^2)^2 and gap after which the tracker
+ * starts over.
+ */
+#define TOF_KF_MEAS_VAR_VALID			25.0f
+#define TOF_KF_MEAS_VAR_INVALID			400.0f
+#define TOF_KF_ACCEL_VAR			40000.0f
+#define TOF_KF_RESET_MS				500
 
 struct micro_communicator_vl53l0 {
 	int range_mm;
 	int distance;
 	int range_status;
 	int measure_mode;
+
+	/* Kernel timestamp of the input events carrying the sample */
+	int64_t stamp_us;
 };
 
+struct ucomm_tof_estimate {
+	int range_mm;
+	int distance;
+
+	/* 0 to 100: share of the window agreeing with the estimate */
+	int confidence;
+	int nsamples;
+
+	/* Timestamp of the newest sample used */
+	int64_t stamp_us;
+};
+
+struct ucomm_tof_track {
+	float range_mm;
+	float velocity;		/* mm/s, positive going away */
+	float variance;		/* of range_mm, in mm^2 */
+
+	/* Time the estimate refers to */
+	int64_t stamp_us;
+};
+
+/* Called by the ToF thread for every new sample: shall not block */
+typedef void (*ucomm_tof_listener_t)(
+	const struct micro_communicator_vl53l0 *sample);
+
 enum {
 	THREAD_TOF,
 	THREAD_MAX
 };
 
-int ucomm_input_tof_read(struct micro_communicator_vl53l0 *stmvl_cur,
-	uint16_t want_code);
-int ucomm_tof_read_stabilized(
-	struct micro_communicator_vl53l0 *stmvl_final,
-	int runs, int nmatch, int sleep_ms, int hyst);
-int ucomm_tof_thr_read_stabilized(
-	struct micro_communicator_vl53l0 *stmvl_final,
-	int runs, int nmatch, int sleep_ms, int hyst);
+int ucomm_tof_get_window(struct micro_communicator_vl53l0 *samples,
+	int max, int max_age_ms);
+int64_t ucomm_tof_now_us(void);
+int ucomm_tof_wait_samples(int64_t since_us, int count, int timeout_ms);
+int ucomm_tof_estimate(struct ucomm_tof_estimate *est,
+	int nsamples, int max_age_ms, int hyst);
+int ucomm_tof_read_estimate(struct ucomm_tof_estimate *est,
+	int nsamples, int min_conf, int hyst, int timeout_ms);
+int ucomm_tof_track_get(struct ucomm_tof_track *trk, int horizon_ms);
+void ucomm_tof_set_listener(ucomm_tof_listener_t listener);
 int ucomm_tof_enable(bool enable);
 int ucomm_input_threadman(bool start, int threadno);
 int ucomm_input_tof_init(void);
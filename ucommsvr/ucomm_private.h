@@ -17,33 +17,34 @@
  * limitations under the License.
  */
 
+#ifndef UCOMM_PRIVATE_H
+#define UCOMM_PRIVATE_H
+
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "ucomm_ext.h"
 
 /* MicroComm Server definitions */
 #define UCOMMSERVER_DIR			"/dev/socket/ucommsvr/"
 #define UCOMMSERVER_SOCKET		UCOMMSERVER_DIR "ucommsvr"
 #define UCOMMSERVER_MAXCONN		10
+#define UCOMMSERVER_MAXCLIENTS		16
 
-#define UCOMMSERVER_CONF_FILE		"/vendor/etc/tof_focus_calibration.xml"
+/* Read-only state page, see struct ucomm_state_page */
+#define UCOMMSERVER_STATE_FILE		UCOMMSERVER_DIR "state"
 
-typedef enum {
-	OP_INITIALIZE = 0,
-	OP_POWER,
-	OP_BRIGHTNESS,
-	OP_FOCUS_SET,
-	OP_KEYSTONE_SET,
-	OP_FOCUS_GET,
-	OP_KEYSTONE_GET,
-	OP_AUTOFOCUS,
-	OP_CONT_AF_SET,
-	OP_MAX,
-} ucomm_svr_ops_t;
+#define UCOMMSERVER_CONF_FILE		"/vendor/etc/tof_focus_calibration.xml"
 
+/* Values to restore, see ucomm_state.h for what the uC reports */
 struct micro_communicator_cached_data {
 	bool light_suspended;
-	uint8_t light;
-	uint8_t focus;
-	uint8_t keystone;
+	int light;
+	int focus;
+	int keystone;
+
+	/* Set once the uC acknowledged a keystone: it cannot report it */
+	bool keystone_valid;
 };
 
 struct micro_communicator_foctbl_entry {
@@ -68,85 +69,103 @@ struct micro_communicator_params {
 	int32_t value;
 };
 
+/* Server internal operations, refused when coming from clients */
+#define OP_INTERNAL_BASE		0x100
+#define OP_CONT_AF_STEP			(OP_INTERNAL_BASE + 0)
+
+/*
+ * Tagged request: the reply starts with the same tag, so that a
+ * client may keep several requests in flight on one connection
+ * and get their completions in any order.
+ * Told apart from the plain one by its size.
+ */
+struct micro_communicator_tagged_params {
+	int32_t operation;
+	int32_t value;
+	uint32_t tag;
+	uint32_t flags;
+};
+
+/*
+ * Batch request: one message carrying up to UCOMM_BATCH_MAX_OPS
+ * operations, executed in order. Only the first count entries of
+ * ops are sent and the reply is an array of count int32_t results,
+ * preceded by the tag if UCOMM_BATCH_TAGGED is set.
+ */
+struct micro_communicator_batch {
+	int32_t operation;		/* OP_BATCH */
+	uint32_t count;
+	uint32_t flags;
+	uint32_t tag;
+	struct micro_communicator_params ops[UCOMM_BATCH_MAX_OPS];
+};
+
+/* Private batch flag: the public ones live in ucomm_ext.h */
+#define UCOMM_BATCH_TAGGED	(1U << 31)
+
+/* Reply to tagged requests: the first n results are sent */
+struct micro_communicator_reply {
+	uint32_t tag;
+	int32_t results[UCOMM_BATCH_MAX_OPS];
+};
+
+#define UCOMM_REPLY_SZ(n)	(sizeof(uint32_t) + sizeof(int32_t) * (n))
+
+/* Server pushed event: never used as a request tag */
+#define UCOMM_EVENT_TAG		0xffffffff
+
+struct micro_communicator_event {
+	uint32_t tag;			/* UCOMM_EVENT_TAG */
+	uint32_t event;			/* UCOMM_EVENT_* */
+	int32_t value;
+	int32_t reserved;
+	int64_t stamp_ms;		/* CLOCK_MONOTONIC */
+};
+
+#define UCOMM_BATCH_HDR_SZ	\
+	(sizeof(struct micro_communicator_batch) -	\
+	 sizeof(struct micro_communicator_params) * UCOMM_BATCH_MAX_OPS)
+#define UCOMM_BATCH_SZ(n)	\
+	(UCOMM_BATCH_HDR_SZ + sizeof(struct micro_communicator_params) * (n))
+
+/*
+ * Projector state, published by the server in a shared file and
+ * protected by a seqlock (ucomm_seqlock.h), so that clients can
+ * read it with no IPC at all. The file is never unlinked, so that
+ * clients mappings stay good across server restarts.
+ */
+#define UCOMM_STATE_PAGE_MAGIC		0x55434d53	/* UCMS */
+#define UCOMM_STATE_PAGE_VERSION	1
+
+struct ucomm_state_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+
+	/* UCOMMSVR_STATE_* bits of the valid fields */
+	uint32_t valid;
+
+	int32_t brightness;
+	int32_t focus;
+	int32_t keystone;
+	int32_t far_max;
+	int32_t near_max;
+
+	/* Latest ToF sample */
+	int32_t tof_range_mm;
+	int32_t tof_status;
+	int64_t tof_stamp_ms;
+
+	/* CLOCK_MONOTONIC time of the last update */
+	int64_t stamp_ms;
+};
+
 int parse_ucomm_xml_data(char* filepath, char* node, 
 			struct micro_communicator_focus_params *ucomm_focus);
 
-#define CTYPE_SHORT_STATUS_REPLY	0x02
-#define CTYPE_SHORT_DATA_REPLY		0x04
-#define CTYPE_LONG_DATA_REPLY		0x0c
-#define FOCUS_CHECKSUM_BASE		0x31
-
 #define REPLY_FOCUS_CUSTOM_LEN		7
 #define REPLY_SHORT_FOCUS_LEN		2
 #define FOCUS_PROCESSING_MAX_PASS	6
 #define FOCTBL_POLYREG_DEGREE		5
 
-				/****  VT    SO   */
-static const uint8_t std_header[] = { 0x0b, 0x0e };
-
-				/****  CR    LF    SI   */
-static const uint8_t std_footer[] = { 0x0d, 0x0a, 0x0f };
-
-/* Initialization sequence */
-static const uint8_t cmd_init_hello[]	= { 0x02, 0x00, 0x02 }; // VERSION
-static const uint8_t cmd_init_unk1[]	= { 0x02, 0x01, 0x03 }; // STATUS
-static const uint8_t cmd_fan_on[]	= { 0x05, 0x80, 0x01,
-					    0x03, 0x7f, 0x08 }; // POWER
-static const uint8_t cmd_init_unk3[]	= { 0x04, 0x55, 0x01,
-					    0x01, 0x5b };
-static const uint8_t cmd_init_led[]	= { 0x08, 0x20, 0x04,
-					    0x00, 0x00, 0x00,
-					    0x00, 0x00, 0x2c };
-
-/* Alive commands */
-static const uint8_t cmd_ir_sensor_on[]	= { 0x03, 0x20, 0x40,
-					    0x63 };
-static const uint8_t cmd_ir_read_mem[]	= { 0x04, 0x19, 0x00,
-					    0xdd, 0xfa };
-static const uint8_t cmd_ir_sensor_off[]= { 0x03, 0x21, 0x40,
-					    0x64 };
-static const uint8_t cmd_light_off[]	= { 0x08, 0x20, 0x04,
-					    0x00, 0x03, 0x0a,
-					    0x00, 0x00, 0x39 };
-static const uint8_t cmd_light_lvl[]	= { 0x08, 0x20, 0x04,
-					    0x00, 0x01, 0x00,
-					    0x00, 0x00, 0x00 };
-static const uint8_t cmd_keystone_val[]	= { 0x05, 0x4b, 0x01,
-					    0x00, 0x00, 0x00 };
-static const uint8_t cmd_focus_query[]	= { 0x07, 0x28, 0x00,
-					    0x00, 0x00, 0x00,
-					    0x00, 0x2f };
-static const uint8_t cmd_focus_reset[]	= { 0x07, 0x28, 0x01,
-					    0x00, 0x00, 0x00,
-					    0x01, 0x31 };
-static const uint8_t cmd_focus_setpos[]	= { 0x07, 0x28, 0x02,
-					    0x00, 0x00, 0x00,
-					    0x00, 0x00 };
-static const uint8_t cmd_focus_up[]	= { 0x07, 0x28, 0x02,
-					    0x00, 0x01, 0x00,
-					    0x00, 0x32 };
-static const uint8_t cmd_focus_down[]	= { 0x07, 0x28, 0x02,
-					    0xff, 0xff, 0x00,
-					    0x00, 0x2f };
-static const uint8_t cmd_unit_reboot[]	= { 0x02, 0xc0, 0xc2 };
-static const uint8_t cmd_power_off[]	= { 0x05, 0x80, 0x02,
-					    0x03, 0x7f, 0x09 };
-static const uint8_t cmd_get_temp1[]	= { 0x03, 0x24, 0x11,
-					    0x38 };
-static const uint8_t cmd_get_temp2[]	= { 0x03, 0x24, 0x12,
-					    0x39 };
-static const uint8_t cmd_get_temp3[]	= { 0x03, 0x24, 0x31,
-					    0x58 };
-
-
-/* Replies */
-static const uint8_t cmd_reply_light_ok[]    = { 0x58, 0x5a };	/* XZ */
-static const uint8_t cmd_reply_focus_up_ok[] = { 0x00, 0x01 };
-static const uint8_t cmd_reply_focus_dn_ok[] = { 0xff, 0xff };
-static const uint8_t cmd_reply_unknown[]     = { 0x44, 0x46 };	/* DF */
-static const uint8_t cmd_reply_sz_mismatch[] = { 0x51, 0x53 };	/* QS */
-static const uint8_t cmd_reply_bad_params[]  = { 0x4e, 0x50 };	/* NP */
-static const uint8_t cmd_reply_nul[]         = { 0x00, 0x00 };
-static const int cmd_reply_len = 2;
-
-
+#endif
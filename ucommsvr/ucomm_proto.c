@@ -0,0 +1,384 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * uC protocol codec
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MicroCommProto"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+
+#include <utils/Log.h>
+
+#include "ucomm_proto.h"
+
+/* Initialization sequence */
+static const uint8_t cmd_init_hello[]	= UCOMM_CMD(0x00);	// VERSION
+static const uint8_t cmd_init_unk1[]	= UCOMM_CMD(0x01);	// STATUS
+static const uint8_t cmd_fan_on[]	= UCOMM_CMD(0x80, 0x01,
+						    0x03, 0x7f); // POWER
+static const uint8_t cmd_init_unk3[]	= UCOMM_CMD(0x55, 0x01, 0x01);
+static const uint8_t cmd_init_led[]	= UCOMM_CMD(0x20, 0x04, 0x00,
+						    0x00, 0x00, 0x00,
+						    0x00);
+
+/* Alive commands */
+static const uint8_t cmd_ir_sensor_on[]	= UCOMM_CMD(0x20, 0x40);
+static const uint8_t cmd_ir_read_mem[]	= UCOMM_CMD(0x19, 0x00, 0xdd);
+static const uint8_t cmd_ir_sensor_off[]= UCOMM_CMD(0x21, 0x40);
+static const uint8_t cmd_light_off[]	= UCOMM_CMD(0x20, 0x04, 0x00,
+						    0x03, 0x0a, 0x00,
+						    0x00);
+static const uint8_t cmd_light_lvl[]	= UCOMM_CMD(0x20, 0x04, 0x00,
+						    0x01, 0x00, 0x00,
+						    0x00);
+static const uint8_t cmd_keystone_val[]	= UCOMM_CMD(0x4b, 0x01, 0x00,
+						    0x00);
+static const uint8_t cmd_focus_query[]	= UCOMM_CMD(0x28, 0x00, 0x00,
+						    0x00, 0x00, 0x00);
+static const uint8_t cmd_focus_reset[]	= UCOMM_CMD(0x28, 0x01, 0x00,
+						    0x00, 0x00, 0x01);
+static const uint8_t cmd_focus_setpos[]	= UCOMM_CMD(0x28, 0x02, 0x00,
+						    0x00, 0x00, 0x00);
+static const uint8_t cmd_focus_up[]	= UCOMM_CMD(0x28, 0x02, 0x00,
+						    0x01, 0x00, 0x00);
+static const uint8_t cmd_focus_down[]	= UCOMM_CMD(0x28, 0x02, 0xff,
+						    0xff, 0x00, 0x00);
+static const uint8_t cmd_unit_reboot[]	= UCOMM_CMD(0xc0);
+static const uint8_t cmd_power_off[]	= UCOMM_CMD(0x80, 0x02,
+						    0x03, 0x7f);
+static const uint8_t cmd_get_temp1[]	= UCOMM_CMD(0x24, 0x11);
+static const uint8_t cmd_get_temp2[]	= UCOMM_CMD(0x24, 0x12);
+static const uint8_t cmd_get_temp3[]	= UCOMM_CMD(0x24, 0x31);
+
+#define UCMD_DESC(_id, _frame, _rtype, _reply)			\
+	[_id] = {						\
+		.name = #_id,					\
+		.frame = _frame,				\
+		.len = ARRAY_SIZE(_frame),			\
+		.reply_ctype = _rtype,				\
+		.reply = _reply,				\
+	}
+
+#define UCMD_DESC_PARAMS(_id, _frame, _rtype, _reply, _np, ...)	\
+	[_id] = {						\
+		.name = #_id,					\
+		.frame = _frame,				\
+		.len = ARRAY_SIZE(_frame),			\
+		.nparams = _np,					\
+		.param_off = { __VA_ARGS__ },			\
+		.reply_ctype = _rtype,				\
+		.reply = _reply,				\
+	}
+
+static const struct ucomm_cmd_desc ucomm_cmds[UCMD_MAX] = {
+	UCMD_DESC(UCMD_INIT_HELLO, cmd_init_hello, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_INIT_STATUS, cmd_init_unk1, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_FAN_ON, cmd_fan_on, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_INIT_UNK3, cmd_init_unk3, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_INIT_LED, cmd_init_led, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_IR_SENSOR_ON, cmd_ir_sensor_on, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_IR_READ_MEM, cmd_ir_read_mem, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_IR_SENSOR_OFF, cmd_ir_sensor_off, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_LIGHT_OFF, cmd_light_off, CTYPE_ANY, NULL),
+
+	/* Light level: VAL */
+	UCMD_DESC_PARAMS(UCMD_LIGHT_LVL, cmd_light_lvl,
+			 CTYPE_SHORT_STATUS_REPLY, cmd_reply_light_ok,
+			 1, 7),
+
+	/* Keystone: SIGN, VAL */
+	UCMD_DESC_PARAMS(UCMD_KEYSTONE, cmd_keystone_val,
+			 CTYPE_SHORT_STATUS_REPLY, cmd_reply_light_ok,
+			 2, 5, 6),
+
+	UCMD_DESC(UCMD_FOCUS_QUERY, cmd_focus_query,
+		  CTYPE_LONG_DATA_REPLY, NULL),
+	UCMD_DESC(UCMD_FOCUS_RESET, cmd_focus_reset, CTYPE_ANY, NULL),
+
+	/* Focus position: BYTE1, BYTE2 */
+	UCMD_DESC_PARAMS(UCMD_FOCUS_SETPOS, cmd_focus_setpos,
+			 CTYPE_SHORT_DATA_REPLY, NULL,
+			 2, 5, 6),
+
+	UCMD_DESC(UCMD_FOCUS_UP, cmd_focus_up,
+		  CTYPE_SHORT_DATA_REPLY, NULL),
+	UCMD_DESC(UCMD_FOCUS_DOWN, cmd_focus_down,
+		  CTYPE_SHORT_DATA_REPLY, NULL),
+	UCMD_DESC(UCMD_UNIT_REBOOT, cmd_unit_reboot, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_POWER_OFF, cmd_power_off, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_GET_TEMP1, cmd_get_temp1, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_GET_TEMP2, cmd_get_temp2, CTYPE_ANY, NULL),
+	UCMD_DESC(UCMD_GET_TEMP3, cmd_get_temp3, CTYPE_ANY, NULL),
+};
+
+/*
+ * ucomm_csum - Computes the checksum of ctype and payload.
+ *
+ * \param buf - Pointer to the ctype byte
+ * \param len - Number of bytes to sum, checksum byte excluded
+ */
+uint8_t ucomm_csum(const uint8_t *buf, int len)
+{
+	uint8_t csum = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		csum += buf[i];
+
+	return csum;
+}
+
+const struct ucomm_cmd_desc *ucomm_cmd_get(ucomm_cmd_t id)
+{
+	if (id < 0 || id >= UCMD_MAX)
+		return NULL;
+
+	return &ucomm_cmds[id];
+}
+
+/*
+ * ucomm_cmd_encode - Builds a command frame with the provided parameters
+ *		      in the caller's buffer and fixes up its checksum.
+ *
+ * \return Returns the frame length or negative errno.
+ */
+int ucomm_cmd_encode(ucomm_cmd_t id, const uint8_t *params, int nparams,
+			uint8_t *out, int out_sz)
+{
+	const struct ucomm_cmd_desc *desc = ucomm_cmd_get(id);
+	int i, csum_off;
+
+	if (desc == NULL || nparams != desc->nparams)
+		return -EINVAL;
+
+	if (out_sz < desc->len)
+		return -ENOSPC;
+
+	memcpy(out, desc->frame, desc->len);
+
+	/* Constant frames already carry their checksum */
+	if (nparams == 0)
+		return desc->len;
+
+	for (i = 0; i < nparams; i++)
+		out[desc->param_off[i]] = params[i];
+
+	csum_off = desc->len - UCOMM_FOOT_LEN - 1;
+	out[csum_off] = ucomm_csum(out + UCOMM_HEAD_LEN,
+				   csum_off - UCOMM_HEAD_LEN);
+
+	return desc->len;
+}
+
+bool ucomm_frame_is_status(const struct ucomm_frame *frame,
+			const uint8_t *status)
+{
+	return frame->ctype == CTYPE_SHORT_STATUS_REPLY &&
+	       !memcmp(frame->data, status, cmd_reply_len);
+}
+
+/*
+ * ucomm_cmd_reply_ok - Checks if a (valid) frame is the reply that the
+ *			command description expects.
+ */
+bool ucomm_cmd_reply_ok(const struct ucomm_cmd_desc *desc,
+			const struct ucomm_frame *frame)
+{
+	if (desc->reply_ctype == CTYPE_ANY)
+		return true;
+
+	if (frame->ctype != desc->reply_ctype)
+		return false;
+
+	if (desc->reply_ctype == CTYPE_SHORT_STATUS_REPLY)
+		return ucomm_frame_is_status(frame, desc->reply);
+
+	/* Data replies echo the opcode */
+	return frame->data[0] == desc->frame[UCOMM_HEAD_LEN + 1];
+}
+
+/*
+ * ucomm_frame_csum_ok - Checks the checksum of a complete frame.
+ *			 Only status replies are known to follow the
+ *			 same rule as the command frames: data replies
+ *			 get through unchecked.
+ */
+static bool ucomm_frame_csum_ok(const struct ucomm_frame *frame)
+{
+	uint8_t csum;
+
+	if (frame->ctype != CTYPE_SHORT_STATUS_REPLY)
+		return true;
+
+	csum = frame->ctype + ucomm_csum(frame->data, frame->ctype - 1);
+
+	return csum == frame->data[frame->ctype - 1];
+}
+
+enum {
+	DEC_WAIT_VT,
+	DEC_WAIT_SO,
+	DEC_CTYPE,
+	DEC_PAYLOAD,
+	DEC_FOOTER,
+};
+
+void ucomm_frame_decoder_reset(struct ucomm_frame_decoder *dec)
+{
+	memset(dec, 0, sizeof(*dec));
+	dec->state = DEC_WAIT_VT;
+}
+
+static void ucomm_frame_push(struct ucomm_frame_decoder *dec)
+{
+	int idx;
+
+	/* Queue full: the oldest reply is the least interesting one */
+	if (dec->q_count == UCOMM_DEC_MAX_FRAMES) {
+		dec->q_head = (dec->q_head + 1) % UCOMM_DEC_MAX_FRAMES;
+		dec->q_count--;
+		dec->dropped_frames++;
+	}
+
+	idx = (dec->q_head + dec->q_count) % UCOMM_DEC_MAX_FRAMES;
+	dec->queue[idx].ctype = dec->cur.ctype;
+	memcpy(dec->queue[idx].data, dec->cur.data, dec->cur.ctype);
+	dec->q_count++;
+}
+
+/*
+ * ucomm_frame_resync - Throws away the frame being assembled.
+ *			If the offending byte may start a new frame,
+ *			don't lose it.
+ */
+static void ucomm_frame_resync(struct ucomm_frame_decoder *dec, uint8_t c)
+{
+	dec->dropped_bytes += dec->pos + 1;
+	dec->pos = 0;
+
+	if (c == std_header[0])
+		dec->state = DEC_WAIT_SO;
+	else
+		dec->state = DEC_WAIT_VT;
+}
+
+/*
+ * ucomm_frame_feed - Runs the framing state machine over a chunk of
+ *		      bytes received from the uC. The chunk may hold
+ *		      any number of (partial) frames: incomplete ones
+ *		      are kept in the decoder until the next call.
+ *
+ * \return Returns the number of frames completed by this chunk.
+ */
+int ucomm_frame_feed(struct ucomm_frame_decoder *dec,
+			const uint8_t *buf, int len)
+{
+	int footer_len = sizeof(std_footer) / sizeof(std_footer[0]);
+	int i, nframes = 0;
+	uint8_t c;
+
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+
+		switch (dec->state) {
+		case DEC_WAIT_VT:
+			if (c == std_header[0])
+				dec->state = DEC_WAIT_SO;
+			else
+				dec->dropped_bytes++;
+			break;
+		case DEC_WAIT_SO:
+			if (c == std_header[1])
+				dec->state = DEC_CTYPE;
+			else
+				ucomm_frame_resync(dec, c);
+			break;
+		case DEC_CTYPE:
+			if (c == 0) {
+				ucomm_frame_resync(dec, c);
+				break;
+			}
+			dec->cur.ctype = c;
+			dec->pos = 0;
+			dec->state = DEC_PAYLOAD;
+			break;
+		case DEC_PAYLOAD:
+			dec->cur.data[dec->pos++] = c;
+			if (dec->pos == dec->cur.ctype) {
+				dec->pos = 0;
+				dec->state = DEC_FOOTER;
+			}
+			break;
+		case DEC_FOOTER:
+			if (c != std_footer[dec->pos]) {
+				ALOGD("Bad footer byte 0x%x at %d", c, dec->pos);
+				ucomm_frame_resync(dec, c);
+				break;
+			}
+			if (++dec->pos < footer_len)
+				break;
+
+			/* Corrupted status replies are rejected right away */
+			if (ucomm_frame_csum_ok(&dec->cur)) {
+				ucomm_frame_push(dec);
+				nframes++;
+			} else {
+				ALOGD("Bad checksum for ctype 0x%x",
+					dec->cur.ctype);
+				dec->bad_csum++;
+			}
+
+			dec->pos = 0;
+			dec->state = DEC_WAIT_VT;
+			break;
+		default:
+			ucomm_frame_decoder_reset(dec);
+			break;
+		}
+	}
+
+	return nframes;
+}
+
+/*
+ * ucomm_frame_pop - Retrieves the oldest complete frame, if any.
+ *
+ * \return Returns true if a frame was copied to the provided pointer.
+ */
+bool ucomm_frame_pop(struct ucomm_frame_decoder *dec,
+			struct ucomm_frame *frame)
+{
+	struct ucomm_frame *head;
+
+	if (dec->q_count == 0)
+		return false;
+
+	head = &dec->queue[dec->q_head];
+	frame->ctype = head->ctype;
+	memcpy(frame->data, head->data, head->ctype);
+
+	dec->q_head = (dec->q_head + 1) % UCOMM_DEC_MAX_FRAMES;
+	dec->q_count--;
+
+	return true;
+}
@@ -0,0 +1,179 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * uC protocol codec
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UCOMM_PROTO_H
+#define UCOMM_PROTO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x)			(sizeof(x) / sizeof((x)[0]))
+#endif
+
+/*
+ * Every frame is VT SO <ctype> <payload> CR LF SI, where ctype
+ * is also the number of payload bytes following it and the last
+ * payload byte is the checksum: the sum of ctype and of all the
+ * other payload bytes, truncated to 8 bits.
+ */
+				/****  VT    SO   */
+static const uint8_t std_header[] = { 0x0b, 0x0e };
+
+				/****  CR    LF    SI   */
+static const uint8_t std_footer[] = { 0x0d, 0x0a, 0x0f };
+
+#define UCOMM_HEAD_LEN			ARRAY_SIZE(std_header)
+#define UCOMM_FOOT_LEN			ARRAY_SIZE(std_footer)
+
+#define UCOMM_FRAME_MAX_LEN		255
+#define UCOMM_DEC_MAX_FRAMES		4
+
+/* Longest command frame, header and footer included */
+#define UCOMM_CMD_MAX_LEN		16
+#define UCOMM_CMD_MAX_PARAMS		2
+
+#define CTYPE_ANY			0x00
+#define CTYPE_SHORT_STATUS_REPLY	0x02
+#define CTYPE_SHORT_DATA_REPLY		0x04
+#define CTYPE_LONG_DATA_REPLY		0x0c
+
+/*
+ * UCOMM_CMD - Builds a complete command frame out of the opcode and
+ *	       its arguments, computing length and checksum at
+ *	       compile time.
+ */
+#define UCOMM_FRAME(...)	{ 0x0b, 0x0e, __VA_ARGS__, 0x0d, 0x0a, 0x0f }
+#define UCOMM_CSUM8(x)		((uint8_t)((x) & 0xff))
+
+#define __UCOMM_NARGS(...)	__UCOMM_NARGS_(__VA_ARGS__, 7, 6, 5, 4, 3, 2, 1)
+#define __UCOMM_NARGS_(_1, _2, _3, _4, _5, _6, _7, N, ...)	N
+#define __UCOMM_CAT(a, b)	a##b
+#define __UCOMM_XCAT(a, b)	__UCOMM_CAT(a, b)
+
+#define __UCOMM_CMD_1(a)	\
+	UCOMM_FRAME(2, a, UCOMM_CSUM8(2 + (a)))
+#define __UCOMM_CMD_2(a, b)	\
+	UCOMM_FRAME(3, a, b, UCOMM_CSUM8(3 + (a) + (b)))
+#define __UCOMM_CMD_3(a, b, c)	\
+	UCOMM_FRAME(4, a, b, c, UCOMM_CSUM8(4 + (a) + (b) + (c)))
+#define __UCOMM_CMD_4(a, b, c, d)	\
+	UCOMM_FRAME(5, a, b, c, d,	\
+		UCOMM_CSUM8(5 + (a) + (b) + (c) + (d)))
+#define __UCOMM_CMD_5(a, b, c, d, e)	\
+	UCOMM_FRAME(6, a, b, c, d, e,	\
+		UCOMM_CSUM8(6 + (a) + (b) + (c) + (d) + (e)))
+#define __UCOMM_CMD_6(a, b, c, d, e, f)	\
+	UCOMM_FRAME(7, a, b, c, d, e, f,	\
+		UCOMM_CSUM8(7 + (a) + (b) + (c) + (d) + (e) + (f)))
+#define __UCOMM_CMD_7(a, b, c, d, e, f, g)	\
+	UCOMM_FRAME(8, a, b, c, d, e, f, g,	\
+		UCOMM_CSUM8(8 + (a) + (b) + (c) + (d) + (e) + (f) + (g)))
+
+#define UCOMM_CMD(...)		\
+	__UCOMM_XCAT(__UCOMM_CMD_, __UCOMM_NARGS(__VA_ARGS__))(__VA_ARGS__)
+
+/* Known uC commands */
+typedef enum {
+	UCMD_INIT_HELLO = 0,
+	UCMD_INIT_STATUS,
+	UCMD_FAN_ON,
+	UCMD_INIT_UNK3,
+	UCMD_INIT_LED,
+	UCMD_IR_SENSOR_ON,
+	UCMD_IR_READ_MEM,
+	UCMD_IR_SENSOR_OFF,
+	UCMD_LIGHT_OFF,
+	UCMD_LIGHT_LVL,
+	UCMD_KEYSTONE,
+	UCMD_FOCUS_QUERY,
+	UCMD_FOCUS_RESET,
+	UCMD_FOCUS_SETPOS,
+	UCMD_FOCUS_UP,
+	UCMD_FOCUS_DOWN,
+	UCMD_UNIT_REBOOT,
+	UCMD_POWER_OFF,
+	UCMD_GET_TEMP1,
+	UCMD_GET_TEMP2,
+	UCMD_GET_TEMP3,
+	UCMD_MAX,
+} ucomm_cmd_t;
+
+struct ucomm_cmd_desc {
+	const char *name;
+
+	/* Complete frame template, with the default parameters */
+	const uint8_t *frame;
+	uint8_t len;
+
+	/* Frame offsets of the runtime parameters */
+	uint8_t nparams;
+	uint8_t param_off[UCOMM_CMD_MAX_PARAMS];
+
+	/* Expected reply: ctype and, for status replies, its payload */
+	uint8_t reply_ctype;
+	const uint8_t *reply;
+};
+
+/* Status replies */
+static const uint8_t cmd_reply_light_ok[]    = { 0x58, 0x5a };	/* XZ */
+static const uint8_t cmd_reply_unknown[]     = { 0x44, 0x46 };	/* DF */
+static const uint8_t cmd_reply_sz_mismatch[] = { 0x51, 0x53 };	/* QS */
+static const uint8_t cmd_reply_bad_params[]  = { 0x4e, 0x50 };	/* NP */
+static const uint8_t cmd_reply_underflow[]   = { 0x5a, 0x5c };	/* Z\ */
+static const int cmd_reply_len = 2;
+
+struct ucomm_frame {
+	uint8_t ctype;
+	uint8_t data[UCOMM_FRAME_MAX_LEN];
+};
+
+struct ucomm_frame_decoder {
+	int state;
+	int pos;
+	struct ucomm_frame cur;
+
+	/* Complete frames, waiting to be popped */
+	struct ucomm_frame queue[UCOMM_DEC_MAX_FRAMES];
+	int q_head;
+	int q_count;
+
+	unsigned int dropped_bytes;
+	unsigned int dropped_frames;
+	unsigned int bad_csum;
+};
+
+uint8_t ucomm_csum(const uint8_t *buf, int len);
+const struct ucomm_cmd_desc *ucomm_cmd_get(ucomm_cmd_t id);
+int ucomm_cmd_encode(ucomm_cmd_t id, const uint8_t *params, int nparams,
+			uint8_t *out, int out_sz);
+bool ucomm_cmd_reply_ok(const struct ucomm_cmd_desc *desc,
+			const struct ucomm_frame *frame);
+bool ucomm_frame_is_status(const struct ucomm_frame *frame,
+			const uint8_t *status);
+
+void ucomm_frame_decoder_reset(struct ucomm_frame_decoder *dec);
+int ucomm_frame_feed(struct ucomm_frame_decoder *dec,
+			const uint8_t *buf, int len);
+bool ucomm_frame_pop(struct ucomm_frame_decoder *dec,
+			struct ucomm_frame *frame);
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * Command jobs queue
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MicroCommQueue"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <utils/Log.h>
+
+#include "ucomm_queue.h"
+
+/*
+ * Jobs come out of a fixed pool, so that queueing a command never
+ * allocates, and are kept in one FIFO per priority class.
+ */
+static struct ucomm_job q_pool[UCOMM_QUEUE_DEPTH];
+static struct ucomm_job *q_free;
+static struct ucomm_job *q_head[UCOMM_PRIO_MAX];
+static struct ucomm_job *q_tail[UCOMM_PRIO_MAX];
+
+static pthread_mutex_t q_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_cond;
+static bool q_run;
+
+int ucomm_queue_init(void)
+{
+	pthread_condattr_t attr;
+	int i, rc;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	rc = pthread_cond_init(&q_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (rc) {
+		ALOGE("Cannot initialize the queue condition");
+		return -rc;
+	}
+
+	pthread_mutex_lock(&q_lock);
+
+	q_free = NULL;
+	for (i = 0; i < UCOMM_QUEUE_DEPTH; i++) {
+		q_pool[i].next = q_free;
+		q_free = &q_pool[i];
+	}
+
+	for (i = 0; i < UCOMM_PRIO_MAX; i++) {
+		q_head[i] = NULL;
+		q_tail[i] = NULL;
+	}
+
+	q_run = true;
+	pthread_mutex_unlock(&q_lock);
+
+	return 0;
+}
+
+/* Wakes up all the waiters, which will get no job from now on */
+void ucomm_queue_shutdown(void)
+{
+	pthread_mutex_lock(&q_lock);
+	q_run = false;
+	pthread_cond_broadcast(&q_cond);
+	pthread_mutex_unlock(&q_lock);
+}
+
+/*
+ * ucomm_job_alloc - Gets a clean job out of the pool.
+ *
+ * \return Returns a job or NULL if too many jobs are in flight.
+ */
+struct ucomm_job *ucomm_job_alloc(void)
+{
+	struct ucomm_job *job;
+
+	pthread_mutex_lock(&q_lock);
+	job = q_free;
+	if (job != NULL)
+		q_free = job->next;
+	pthread_mutex_unlock(&q_lock);
+
+	if (job == NULL)
+		return NULL;
+
+	memset(job, 0, sizeof(*job));
+
+	return job;
+}
+
+void ucomm_job_free(struct ucomm_job *job)
+{
+	pthread_mutex_lock(&q_lock);
+	job->next = q_free;
+	q_free = job;
+	pthread_mutex_unlock(&q_lock);
+}
+
+/*
+ * ucomm_queue_push - Queues a job for the UART thread.
+ *		      A coalescing job takes the place of a pending one
+ *		      for the same operation, which is handed back to
+ *		      the caller, that shall complete it as superseded.
+ *
+ * \return Returns zero or negative errno.
+ */
+int ucomm_queue_push(struct ucomm_job *job, struct ucomm_job **superseded)
+{
+	struct ucomm_job *cur, *prev = NULL;
+	ucomm_prio_t prio = job->prio;
+
+	if (prio >= UCOMM_PRIO_MAX)
+		prio = job->prio = UCOMM_PRIO_BACKGROUND;
+
+	job->next = NULL;
+	if (superseded)
+		*superseded = NULL;
+
+	pthread_mutex_lock(&q_lock);
+	if (!q_run) {
+		pthread_mutex_unlock(&q_lock);
+		return -ESHUTDOWN;
+	}
+
+	if (job->coalesce && superseded) {
+		for (cur = q_head[prio]; cur; prev = cur, cur = cur->next) {
+			if (!cur->coalesce ||
+			    cur->params.operation != job->params.operation)
+				continue;
+
+			/* Keep the place in the queue, take the new value */
+			job->next = cur->next;
+			if (prev)
+				prev->next = job;
+			else
+				q_head[prio] = job;
+			if (q_tail[prio] == cur)
+				q_tail[prio] = job;
+
+			cur->next = NULL;
+			*superseded = cur;
+			goto end;
+		}
+	}
+
+	if (q_tail[prio])
+		q_tail[prio]->next = job;
+	else
+		q_head[prio] = job;
+	q_tail[prio] = job;
+
+end:
+	pthread_cond_broadcast(&q_cond);
+	pthread_mutex_unlock(&q_lock);
+
+	return 0;
+}
+
+/*
+ * ucomm_queue_pending - Checks if a job for the specified operation
+ *			 is waiting in the queue.
+ */
+bool ucomm_queue_pending(int32_t operation)
+{
+	struct ucomm_job *cur;
+	bool found = false;
+	int i;
+
+	pthread_mutex_lock(&q_lock);
+	for (i = 0; i < UCOMM_PRIO_MAX && !found; i++) {
+		for (cur = q_head[i]; cur; cur = cur->next) {
+			if (cur->params.operation == operation) {
+				found = true;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&q_lock);
+
+	return found;
+}
+
+/* Must be called with q_lock held */
+static struct ucomm_job *__ucomm_queue_dequeue(ucomm_prio_t below)
+{
+	struct ucomm_job *job;
+	int i;
+
+	for (i = 0; i < (int)below && i < UCOMM_PRIO_MAX; i++) {
+		job = q_head[i];
+		if (job == NULL)
+			continue;
+
+		q_head[i] = job->next;
+		if (q_head[i] == NULL)
+			q_tail[i] = NULL;
+		job->next = NULL;
+
+		return job;
+	}
+
+	return NULL;
+}
+
+/*
+ * ucomm_queue_pop - Retrieves the most urgent queued job, among the
+ *		     priority classes more urgent than the one specified.
+ *
+ * \param below - Only consider classes numerically lower than this
+ * \param timeout_ms - Maximum wait time: zero to poll, negative to
+ *		       wait forever
+ *
+ * \return Returns a job or NULL on timeout or shutdown.
+ */
+struct ucomm_job *ucomm_queue_pop(ucomm_prio_t below, int timeout_ms)
+{
+	struct ucomm_job *job;
+	struct timespec ts;
+	int rc = 0;
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&q_lock);
+	while (q_run) {
+		job = __ucomm_queue_dequeue(below);
+		if (job != NULL) {
+			pthread_mutex_unlock(&q_lock);
+			return job;
+		}
+
+		if (timeout_ms == 0 || rc == ETIMEDOUT)
+			break;
+
+		if (timeout_ms < 0)
+			rc = pthread_cond_wait(&q_cond, &q_lock);
+		else
+			rc = pthread_cond_timedwait(&q_cond, &q_lock, &ts);
+	}
+	pthread_mutex_unlock(&q_lock);
+
+	return NULL;
+}
@@ -0,0 +1,73 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * Command jobs queue
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UCOMM_QUEUE_H
+#define UCOMM_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ucomm_private.h"
+#include "ucomm_conn.h"
+
+#define UCOMM_QUEUE_DEPTH		32
+
+/* Lower value means more urgent */
+typedef enum {
+	UCOMM_PRIO_INTERACTIVE = 0,
+	UCOMM_PRIO_NORMAL,
+	UCOMM_PRIO_BACKGROUND,
+	UCOMM_PRIO_MAX,
+} ucomm_prio_t;
+
+struct ucomm_job {
+	struct micro_communicator_params params;
+	ucomm_prio_t prio;
+
+	/* Pending jobs for the same operation collapse to the newest */
+	bool coalesce;
+
+	/* OP_BATCH: operations to run in order, one result each */
+	uint32_t batch_flags;
+	int nops;
+	struct micro_communicator_params ops[UCOMM_BATCH_MAX_OPS];
+	int32_t results[UCOMM_BATCH_MAX_OPS];
+
+	/* Tagged requests get the tag back along with the result */
+	bool tagged;
+	uint32_t tag;
+
+	/* Client connection waiting for the result, referenced */
+	struct ucomm_conn *conn;
+	int32_t result;
+
+	struct ucomm_job *next;
+};
+
+int ucomm_queue_init(void);
+void ucomm_queue_shutdown(void);
+struct ucomm_job *ucomm_job_alloc(void);
+void ucomm_job_free(struct ucomm_job *job);
+int ucomm_queue_push(struct ucomm_job *job, struct ucomm_job **superseded);
+struct ucomm_job *ucomm_queue_pop(ucomm_prio_t below, int timeout_ms);
+bool ucomm_queue_pending(int32_t operation);
+
+#endif
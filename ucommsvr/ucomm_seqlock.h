@@ -0,0 +1,59 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * Sequence lock, for lockless readers
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UCOMM_SEQLOCK_H
+#define UCOMM_SEQLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The sequence is odd while a writer is updating the protected data:
+ * readers copy the data out and retry if the sequence was odd or has
+ * changed in the meanwhile. Writers must be serialized by the caller.
+ * Works across processes, on shared memory, too.
+ */
+static inline void ucomm_seqlock_write_begin(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void ucomm_seqlock_write_end(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns an odd value if a writer is in progress */
+static inline uint32_t ucomm_seqlock_read_begin(const uint32_t *seq)
+{
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+/* Checks if the data copied since read_begin() shall be discarded */
+static inline bool ucomm_seqlock_read_retry(const uint32_t *seq,
+					    uint32_t start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (start & 1) || __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * Projector state cache
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MicroCommState"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <private/android_filesystem_config.h>
+#include <utils/Log.h>
+
+#include "ucomm_private.h"
+#include "ucomm_seqlock.h"
+#include "ucomm_state.h"
+
+/*
+ * Last values acknowledged or reported by the uC, along with the
+ * time they were learnt: getters are served from here, so that they
+ * never have to wait for the UART thread unless asked to.
+ */
+struct ucomm_state_entry {
+	bool valid;
+	int32_t value;
+	int64_t stamp_ms;
+};
+
+static struct ucomm_state_entry ucomm_state[UCOMM_STATE_MAX];
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Shared copy for the clients, NULL if it could not be set up */
+static struct ucomm_state_page *state_page;
+
+static const uint32_t state_page_bits[UCOMM_STATE_MAX] = {
+	[UCOMM_STATE_LIGHT]	= UCOMMSVR_STATE_BRIGHTNESS,
+	[UCOMM_STATE_FOCUS]	= UCOMMSVR_STATE_FOCUS,
+	[UCOMM_STATE_KEYSTONE]	= UCOMMSVR_STATE_KEYSTONE,
+};
+
+static int64_t ucomm_state_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * ucomm_state_page_map - Maps the shared state page. The file gets
+ *			  reused if it exists already, so that clients
+ *			  which mapped it before a server restart keep
+ *			  seeing the updates.
+ *
+ * \return Returns zero or negative errno.
+ */
+static int ucomm_state_page_map(void)
+{
+	void *page;
+	uint32_t seq;
+	int fd, rc = 0;
+
+	fd = open(UCOMMSERVER_STATE_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ALOGE("Cannot create the state page");
+		return -errno;
+	}
+
+	fchown(fd, AID_ROOT, AID_SYSTEM);
+	fchmod(fd, 0644);
+
+	if (ftruncate(fd, sizeof(struct ucomm_state_page)) < 0) {
+		rc = -errno;
+		goto end;
+	}
+
+	page = mmap(NULL, sizeof(struct ucomm_state_page),
+		    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		rc = -errno;
+		goto end;
+	}
+	state_page = page;
+
+	/*
+	 * Keep the sequence going: readers may be in the middle of it.
+	 * An odd count is left behind by a server that died within a
+	 * write, though, and would keep them retrying: move past it.
+	 */
+	seq = __atomic_load_n(&state_page->seq, __ATOMIC_RELAXED);
+	if (seq & 1) {
+		ALOGW("State page left mid-update, resetting the sequence");
+		__atomic_store_n(&state_page->seq, seq + 1, __ATOMIC_RELEASE);
+	}
+
+	ucomm_seqlock_write_begin(&state_page->seq);
+	state_page->magic = UCOMM_STATE_PAGE_MAGIC;
+	state_page->version = UCOMM_STATE_PAGE_VERSION;
+	state_page->valid = 0;
+	state_page->stamp_ms = ucomm_state_now_ms();
+	ucomm_seqlock_write_end(&state_page->seq);
+end:
+	if (rc < 0)
+		ALOGE("Cannot map the state page: %d", rc);
+	close(fd);
+	return rc;
+}
+
+/* Must be called with state_lock held */
+static void __ucomm_state_publish(ucomm_state_id_t id)
+{
+	int32_t *field;
+
+	if (state_page == NULL)
+		return;
+
+	switch (id) {
+	case UCOMM_STATE_LIGHT:
+		field = &state_page->brightness;
+		break;
+	case UCOMM_STATE_FOCUS:
+		field = &state_page->focus;
+		break;
+	case UCOMM_STATE_KEYSTONE:
+		field = &state_page->keystone;
+		break;
+	default:
+		return;
+	}
+
+	ucomm_seqlock_write_begin(&state_page->seq);
+	*field = ucomm_state[id].value;
+	if (ucomm_state[id].valid)
+		state_page->valid |= state_page_bits[id];
+	else
+		state_page->valid &= ~state_page_bits[id];
+	state_page->stamp_ms = ucomm_state_now_ms();
+	ucomm_seqlock_write_end(&state_page->seq);
+}
+
+/*
+ * ucomm_state_init - Forgets everything and sets up the shared page.
+ *		      Failing to do the latter only costs the clients
+ *		      their IPC-less reads.
+ *
+ * \return Returns zero or negative errno.
+ */
+int ucomm_state_init(void)
+{
+	int i, rc = 0;
+
+	pthread_mutex_lock(&state_lock);
+	for (i = 0; i < UCOMM_STATE_MAX; i++)
+		ucomm_state[i].valid = false;
+
+	if (state_page == NULL)
+		rc = ucomm_state_page_map();
+	pthread_mutex_unlock(&state_lock);
+
+	return rc;
+}
+
+/* Records a value confirmed by the uC */
+void ucomm_state_update(ucomm_state_id_t id, int32_t value)
+{
+	if (id >= UCOMM_STATE_MAX)
+		return;
+
+	pthread_mutex_lock(&state_lock);
+	ucomm_state[id].valid = true;
+	ucomm_state[id].value = value;
+	ucomm_state[id].stamp_ms = ucomm_state_now_ms();
+	__ucomm_state_publish(id);
+	pthread_mutex_unlock(&state_lock);
+}
+
+/* The uC state is unknown, until the next update */
+void ucomm_state_invalidate(ucomm_state_id_t id)
+{
+	if (id >= UCOMM_STATE_MAX)
+		return;
+
+	pthread_mutex_lock(&state_lock);
+	ucomm_state[id].valid = false;
+	__ucomm_state_publish(id);
+	pthread_mutex_unlock(&state_lock);
+}
+
+/* Lens travel limits, as reported by the uC: published only */
+void ucomm_state_set_focus_range(int32_t far_max, int32_t near_max)
+{
+	pthread_mutex_lock(&state_lock);
+	if (state_page != NULL) {
+		ucomm_seqlock_write_begin(&state_page->seq);
+		state_page->far_max = far_max;
+		state_page->near_max = near_max;
+		state_page->valid |= UCOMMSVR_STATE_FOCUS_RANGE;
+		state_page->stamp_ms = ucomm_state_now_ms();
+		ucomm_seqlock_write_end(&state_page->seq);
+	}
+	pthread_mutex_unlock(&state_lock);
+}
+
+/* Latest ToF sample: published only */
+void ucomm_state_set_tof(int32_t range_mm, int32_t status)
+{
+	int64_t now = ucomm_state_now_ms();
+
+	pthread_mutex_lock(&state_lock);
+	if (state_page != NULL) {
+		ucomm_seqlock_write_begin(&state_page->seq);
+		state_page->tof_range_mm = range_mm;
+		state_page->tof_status = status;
+		state_page->tof_stamp_ms = now;
+		state_page->valid |= UCOMMSVR_STATE_TOF;
+		state_page->stamp_ms = now;
+		ucomm_seqlock_write_end(&state_page->seq);
+	}
+	pthread_mutex_unlock(&state_lock);
+}
+
+/*
+ * ucomm_state_get - Gets a cached value, if recent enough.
+ *
+ * \param max_age_ms - Maximum age of the value: zero accepts any
+ *		       valid value, negative never hits the cache
+ *
+ * \return Returns zero or -ENODATA if the uC shall be queried.
+ */
+int ucomm_state_get(ucomm_state_id_t id, int max_age_ms, int32_t *value)
+{
+	int rc = -ENODATA;
+
+	if (id >= UCOMM_STATE_MAX || max_age_ms < 0)
+		return -ENODATA;
+
+	pthread_mutex_lock(&state_lock);
+	if (ucomm_state[id].valid &&
+	    (max_age_ms == 0 ||
+	     ucomm_state_now_ms() - ucomm_state[id].stamp_ms <= max_age_ms)) {
+		*value = ucomm_state[id].value;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&state_lock);
+
+	return rc;
+}
+
+/* Checks if the uC already has the specified value */
+bool ucomm_state_matches(ucomm_state_id_t id, int32_t value)
+{
+	int32_t cur;
+
+	if (ucomm_state_get(id, 0, &cur) < 0)
+		return false;
+
+	return cur == value;
+}
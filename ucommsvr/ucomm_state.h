@@ -0,0 +1,43 @@
+/*
+ * Micro Communicator for Projection uC
+ * a High-Speed Serial communications server
+ *
+ * Projector state cache
+ *
+ * Copyright (C) 2018 AngeloGioacchino Del Regno <kholk11@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UCOMM_STATE_H
+#define UCOMM_STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+	UCOMM_STATE_LIGHT = 0,
+	UCOMM_STATE_FOCUS,
+	UCOMM_STATE_KEYSTONE,
+	UCOMM_STATE_MAX,
+} ucomm_state_id_t;
+
+int ucomm_state_init(void);
+void ucomm_state_update(ucomm_state_id_t id, int32_t value);
+void ucomm_state_invalidate(ucomm_state_id_t id);
+int ucomm_state_get(ucomm_state_id_t id, int max_age_ms, int32_t *value);
+bool ucomm_state_matches(ucomm_state_id_t id, int32_t value);
+void ucomm_state_set_focus_range(int32_t far_max, int32_t near_max);
+void ucomm_state_set_tof(int32_t range_mm, int32_t status);
+
+#endif
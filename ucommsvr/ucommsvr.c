@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -30,6 +31,8 @@
 #include <errno.h>
 #include <assert.h>
 #include <termios.h>
+#include <time.h>
+#include <poll.h>
 
 #include <private/android_filesystem_config.h>
 #include <utils/Log.h>
@@ -38,6 +41,11 @@
 #include "ucomm_private.h"
 #include "ucomm_input.h"
 #include "ucomm_ext.h"
+#include "ucomm_proto.h"
+#include "ucomm_queue.h"
+#include "ucomm_conn.h"
+#include "ucomm_state.h"
+#include "ucomm_focus_model.h"
 
 #define LOG_TAG			"MicroComm"
 
@@ -51,6 +59,27 @@
 #define SERPARM_OFLAGS		(0)
 #define SERPARM_LFLAGS		(0)
 
+/*
+ * Reply deadlines: the uC usually answers within a couple of
+ * milliseconds, but focus queries may take longer while the
+ * lens motor is being driven.
+ */
+#define UART_CMD_TIMEOUT_MS	20
+#define UART_QUERY_TIMEOUT_MS	40
+#define UART_RX_BUF_SZ		64
+
+/*
+ * Continuous AF: the lens follows the tracked range once it stays
+ * off the dead band for the dwell time, in moves of at most
+ * CONT_AF_MAX_STEPS, as long as the target is not moving faster
+ * than CONT_AF_MAX_SPEED (mm/s) and the track is precise enough.
+ */
+#define CONT_AF_DEADBAND_MM	30
+#define CONT_AF_DWELL_MS	400
+#define CONT_AF_MAX_SPEED	50
+#define CONT_AF_MAX_VAR		100
+#define CONT_AF_MAX_STEPS	40
+
 #define UNUSED __attribute__((unused))
 
 /* Serial port fd */
@@ -58,78 +87,212 @@ static int serport = -1;
 static struct micro_communicator_cached_data ucomm_cached;
 static struct micro_communicator_focus_params focus_conf;
 static struct micro_communicator_focus_state  focus_state;
+static struct ucomm_focus_fixed focus_fixed;
+static struct ucomm_frame_decoder uart_dec;
 
 /* MicroComm Server */
 static int sock;
-static int clientsock;
+static int epfd = -1;
 static struct sockaddr_un server_addr;
 static pthread_t ucommsvr_thread;
 static bool ucthread_run = true;
 
+/*
+ * Continuous AF state: the ToF thread decides when a correction is
+ * needed and queues it, the UART thread moves the lens.
+ */
+static struct {
+	bool enabled;
+	bool queued;
+
+	/* Range the lens is focused for */
+	bool ref_valid;
+	float ref_mm;
+
+	/* Since when the range is off the dead band, zero if it is not */
+	int64_t out_since_us;
+} cont_af;
+static pthread_mutex_t cont_af_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool tof_ready;
+
+/* UART I/O thread: the only one allowed to talk to the uC */
+static pthread_t ucomm_uart_pthread;
+static ucomm_prio_t ucomm_cur_prio = UCOMM_PRIO_MAX;
+
+static void ucomm_worker_sleep(int ms);
+
 /* Debugging defines */
 // #define DEBUG_FOCUS_STEPTEST
 // #define DEBUG_CMDS
 // #define DEBUG_FOCUS
 
+/* Convert ranges with the fixed point evaluator instead of the table */
+// #define FOCUS_FIXED_POINT
+
+#ifdef FOCUS_FIXED_POINT
+#define FOCUS_PREFER_FIXED	true
+#else
+#define FOCUS_PREFER_FIXED	false
+#endif
+
+/*
+ * uart_now_ms - Monotonic clock, in milliseconds, used to track
+ *		 the per-command reply deadlines.
+ */
+static int64_t uart_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/*
+ * uart_wait_frame - Waits on the serial port until the decoder has
+ *		     a complete reply frame or the deadline expires.
+ *		     Bytes beyond the returned frame are kept in the
+ *		     decoder for the next call.
+ *
+ * \return Returns 1 if a frame was received, zero on timeout
+ *	   or negative errno.
+ */
+static int uart_wait_frame(int fd, struct ucomm_frame *frame,
+			   int64_t deadline)
+{
+	struct pollfd pfd;
+	uint8_t buf[UART_RX_BUF_SZ];
+	int remain, rc;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (!ucomm_frame_pop(&uart_dec, frame)) {
+		remain = (int)(deadline - uart_now_ms());
+		if (remain <= 0)
+			return 0;
+
+		rc = poll(&pfd, 1, remain);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (rc == 0)
+			return 0;
+
+		rc = read(fd, buf, sizeof(buf));
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+
+			/* Whatever was being assembled is lost */
+			rc = -errno;
+			ucomm_frame_decoder_reset(&uart_dec);
+			return rc;
+		}
+
+#ifdef DEBUG_CMDS
+		for (remain = 0; remain < rc; remain++)
+			ALOGE("Recv: %02x", buf[remain]);
+#endif
+		ucomm_frame_feed(&uart_dec, buf, rc);
+	}
+
+	return 1;
+}
+
+/*
+ * uart_drain - Feeds the decoder with the input already received and
+ *		drops the complete frames, that nobody is waiting for.
+ *		A frame still being received stays in the decoder, so
+ *		that its remaining bytes do not get mistaken for the
+ *		start of the next reply.
+ */
+static void uart_drain(int fd)
+{
+	struct ucomm_frame frame;
+	uint8_t buf[UART_RX_BUF_SZ];
+	int rc;
+
+	do {
+		rc = read(fd, buf, sizeof(buf));
+		if (rc > 0)
+			ucomm_frame_feed(&uart_dec, buf, rc);
+	} while (rc == (int)sizeof(buf) || (rc < 0 && errno == EINTR));
+
+	while (ucomm_frame_pop(&uart_dec, &frame))
+		uart_dec.dropped_frames++;
+}
+
+/*
+ * uart_send_frame - Drops any stale reply and sends a command frame.
+ *
+ * \param flush_out - Also drop the output not transmitted yet
+ */
+static void uart_send_frame(int fd, const uint8_t cmd[], int cmd_sz,
+			    bool flush_out)
+{
+	if (flush_out)
+		tcflush(fd, TCOFLUSH);
+	uart_drain(fd);
+	write(fd, cmd, cmd_sz);
+}
+
 /*
- * sendcmd_query - Sends a command to the uC via serial.
+ * sendcmd - Sends a command to the uC via serial and checks that
+ *	     the reply is the one described by the codec.
  *
  * \return Returns success or negative number for error.
  */
-static int sendcmd(int fd, uint8_t cmd[], int cmd_sz,
-		const uint8_t reply[], int reply_len)
+static int sendcmd(int fd, const struct ucomm_cmd_desc *desc,
+		const uint8_t cmd[], int cmd_sz)
 {
-	int i, rc = -2, retry = 0, sz_ans = 32;
-	char buf[40];
+	int i, rc = -2, retry = 0;
+	int64_t deadline;
+	struct ucomm_frame frame;
 
 #ifdef DEBUG_CMDS
 	for (i = 0; i < cmd_sz; i++) {
-		ALOGE("SEND: %2x", buf[i]);
+		ALOGE("SEND: %2x", cmd[i]);
 	}
 #endif
 
-	do {
-		tcdrain(fd);
-		usleep(50);
-		write(fd, cmd, cmd_sz);
-		usleep(75);
-
-		ioctl(fd, FIONREAD, &sz_ans);
-		if (sz_ans <= 0)
-			continue;
+	frame.ctype = 0;
 
-		if (sz_ans > 40)
-			sz_ans = 40;
+	do {
+		uart_send_frame(fd, cmd, cmd_sz, false);
+		deadline = uart_now_ms() + UART_CMD_TIMEOUT_MS;
 
-		rc = read(fd, buf, sz_ans);
-		if (buf[0] == 0x0b &&
-		    buf[1] == 0x0e) {
-			rc = 0;
-			/* If VT SO received, check reply */
-			for (i = 0; i < reply_len; i++) {
-				if (buf[i+3] != reply[i])
-					rc = -3;
+		rc = -2;
+		while (uart_wait_frame(fd, &frame, deadline) > 0) {
+			if (ucomm_cmd_reply_ok(desc, &frame)) {
+				rc = 0;
+				break;
 			}
 
-			/* If no reply to check, force OK */
-			if (!reply_len)
-				rc = 0;
-		}
-		else {
-			rc = -2;
+			/* A status reply to us, but not the expected one */
+			rc = -3;
+			if (frame.ctype == CTYPE_SHORT_STATUS_REPLY)
+				break;
+
+			/*
+			 * Data replies are late answers to something
+			 * else: skip them and keep waiting for ours.
+			 */
 		}
 		if (rc == 0)
 			return 0;
 		retry++;
 	} while (retry < 4);
 
-
 	if (rc == -2)
-		ALOGE("INVALID RX DATA: 0x%x 0x%x",
-				buf[0], buf[1]);
+		ALOGE("%s: NO VALID RX DATA (%u bytes dropped, %u bad csum)",
+				desc->name, uart_dec.dropped_bytes,
+				uart_dec.bad_csum);
 	else if (rc == -3)
-		ALOGE("INVALID REPLY: 0x%x 0x%x",
-				buf[2], buf[3]);
+		ALOGE("%s: INVALID REPLY: 0x%x 0x%x",
+				desc->name, frame.ctype, frame.data[0]);
 
 	return rc;
 }
@@ -142,96 +305,68 @@ static int sendcmd(int fd, uint8_t cmd[], int cmd_sz,
  *
  * \return Returns reply length or negative number for error.
  */
-static int sendcmd_query(int fd, uint8_t cmd[], int cmd_sz,
+static int sendcmd_query(int fd, const uint8_t cmd[], int cmd_sz,
 			uint8_t *reply, int nretries)
 {
-	int i, rc = -2, retry = 0, sz_ans = 32;
-	char buf[40];
-
-	do {
-		//tcdrain(fd);
-		tcflush(fd, TCIOFLUSH);
-		usleep(25);
-		write(fd, cmd, cmd_sz);
-		tcdrain(fd);
-		usleep(8000);
+	int rc = -2, retry = 0;
+	int64_t deadline;
+	struct ucomm_frame frame;
 
-		ioctl(fd, FIONREAD, &sz_ans);
-		if (sz_ans <= 0) {
-			usleep(12000);
-
-			/* Retry ONE more time */
-			ioctl(fd, FIONREAD, &sz_ans);
-			if (sz_ans <= 0)
-				continue;
-		}
-
-		if (sz_ans > 40)
-			sz_ans = 40;
+	frame.ctype = 0;
 
-		rc = read(fd, buf, sz_ans);
-
-#ifdef DEBUG_CMDS
-		for (i = 0; i < sz_ans; i++) {
-			ALOGE("Recv: %02x", buf[i]);
-		}
-#endif
+	do {
+		uart_send_frame(fd, cmd, cmd_sz, true);
+		deadline = uart_now_ms() + UART_QUERY_TIMEOUT_MS;
 
-		/* If VT SO received, check reply */
-		if (buf[0] == 0x0b &&
-		    buf[1] == 0x0e) {
-			rc = 0;
+		rc = -2;
+		while (uart_wait_frame(fd, &frame, deadline) > 0) {
 			/* Focus set position reply */
-			if (buf[2] == 0x04 &&
-			    buf[3] == 0x28) {
-				reply[0] = buf[4]; /* BYTE1 */
-				reply[1] = buf[5]; /* BYTE2 */
-				reply[2] = buf[6]; /* CTRL */
+			if (frame.ctype == CTYPE_SHORT_DATA_REPLY &&
+			    frame.data[0] == 0x28) {
+				reply[0] = frame.data[1]; /* BYTE1 */
+				reply[1] = frame.data[2]; /* BYTE2 */
+				reply[2] = frame.data[3]; /* CTRL */
 				return REPLY_SHORT_FOCUS_LEN;
 			}
 
 			/* Focus position query reply */
-			if (buf[2] == 0x0c &&
-			    buf[3] == 0x28) {
-				reply[0] = buf[4]; /* BYTE1 */
-				reply[1] = buf[5]; /* BYTE2 */
-				reply[2] = buf[12]; /* Sign (+/-) */
-				reply[3] = buf[6]; /* NEAR BYTE1 */
-				reply[4] = buf[7]; /* NEAR BYTE2 */
-				reply[5] = buf[8]; /* FAR BYTE1 */
-				reply[6] = buf[9]; /* FAR BYTE1 */
+			if (frame.ctype == CTYPE_LONG_DATA_REPLY &&
+			    frame.data[0] == 0x28) {
+				reply[0] = frame.data[1]; /* BYTE1 */
+				reply[1] = frame.data[2]; /* BYTE2 */
+				reply[2] = frame.data[9]; /* Sign (+/-) */
+				reply[3] = frame.data[3]; /* NEAR BYTE1 */
+				reply[4] = frame.data[4]; /* NEAR BYTE2 */
+				reply[5] = frame.data[5]; /* FAR BYTE1 */
+				reply[6] = frame.data[6]; /* FAR BYTE1 */
 				return REPLY_FOCUS_CUSTOM_LEN;
 			}
 
 			/* Focus overflow and underflow errors */
-			if (buf[2] == 0x02 &&
-			    buf[3] == 0x44 &&
-			    buf[4] == 0x46)
+			if (ucomm_frame_is_status(&frame, cmd_reply_unknown))
 				return ERR_UCOMM_FOCUS_OVERFLOW;
-			else if (buf[2] == 0x02 &&
-				 buf[3] == 0x5a &&
-				 buf[4] == 0x5c)
+			else if (ucomm_frame_is_status(&frame,
+						       cmd_reply_underflow))
 				return ERR_UCOMM_FOCUS_UNDERFLOW;
 
 			/* Unknown and unexpected reply. Can retry. */
-			if (buf[2] != 0x04 &&
-			    buf[2] != 0x0c)
+			if (frame.ctype == CTYPE_SHORT_STATUS_REPLY) {
 				rc = -3;
+				break;
+			}
+
+			/* Not for us: keep waiting for our reply */
+			rc = -3;
 		}
-		else {
-			rc = -2;
-		}
-		if (rc == 0)
-			return 0;
 		retry++;
 	} while (retry < nretries);
 
 	if (rc == -2)
-		ALOGE("INVALID RX DATA: 0x%x 0x%x",
-				buf[0], buf[1]);
+		ALOGE("NO VALID RX DATA: %u bytes dropped",
+				uart_dec.dropped_bytes);
 	else if (rc == -3)
 		ALOGE("UNEXPECTED REPLY: 0x%x 0x%x",
-				buf[2], buf[3]);
+				frame.ctype, frame.data[0]);
 	return rc;
 }
 
@@ -265,76 +400,54 @@ static int sendcmd(int fd, uint8_t cmd[], int cmd_sz)
 }
 #endif
 
-uint8_t *__concat_cmd(const uint8_t head[],
-			const uint8_t cmd[],
-			int head_len, int cmd_len, int *full_sz)
+/*
+ * send_cmd - Sends a constant command, as prebuilt by the codec.
+ */
+static int send_cmd(int fd, ucomm_cmd_t id)
 {
-	int footer_len = sizeof(std_footer) / sizeof(std_footer[0]);
-	uint8_t *full_cmd = NULL;
-
-	*full_sz = (head_len + cmd_len + footer_len) * sizeof(uint8_t);
-
-	full_cmd = malloc(*full_sz);
+	const struct ucomm_cmd_desc *desc = ucomm_cmd_get(id);
 
-	if (full_cmd == NULL) {
-		ALOGE("Memory exhausted. Cannot allocate.\n");
-		return NULL;
-	}
-
-	memcpy(full_cmd, head, head_len);
-	memcpy(full_cmd + head_len, cmd, cmd_len);
-	memcpy(full_cmd + head_len + cmd_len, std_footer, footer_len);
-
-	return full_cmd;
+	return sendcmd(fd, desc, desc->frame, desc->len);
 }
 
-int send_concat_cmd(int fd, const uint8_t head[],
-			const uint8_t cmd[],
-			int head_len, int cmd_len)
+/*
+ * send_cmd_params - Encodes a parameterized command and sends it.
+ */
+static int send_cmd_params(int fd, ucomm_cmd_t id,
+			   const uint8_t *params, int nparams)
 {
-	int footer_len = sizeof(std_footer) / sizeof(std_footer[0]);
-	int full_sz = 0;
-	uint8_t *full_cmd = __concat_cmd(head, cmd,
-					head_len, cmd_len, &full_sz);
-	if (full_cmd == NULL)
+	uint8_t full_cmd[UCOMM_CMD_MAX_LEN];
+	int len;
+
+	len = ucomm_cmd_encode(id, params, nparams,
+			       full_cmd, sizeof(full_cmd));
+	if (len < 0)
 		return -2;
 
-	return sendcmd(fd, full_cmd, full_sz, cmd_reply_nul, 0);
+	return sendcmd(fd, ucomm_cmd_get(id), full_cmd, len);
 }
 
 int send_init_sequence(int fd)
 {
 	int rc;
-	int head_len = sizeof(std_header) / sizeof(std_header[0]);
-	int cmd_len;
 
-	cmd_len = sizeof(cmd_init_hello) / sizeof(cmd_init_hello[0]);
-	rc = send_concat_cmd(fd, std_header, cmd_init_hello,
-				head_len, cmd_len);
+	rc = send_cmd(fd, UCMD_INIT_HELLO);
 	if (rc)
 		goto end;
 
-	cmd_len = sizeof(cmd_init_unk1) / sizeof(cmd_init_unk1[0]);
-	rc = send_concat_cmd(fd, std_header, cmd_init_unk1,
-				head_len, cmd_len);
+	rc = send_cmd(fd, UCMD_INIT_STATUS);
 	if (rc)
 		goto end;
 
-	cmd_len = sizeof(cmd_fan_on) / sizeof(cmd_fan_on[0]);
-	rc = send_concat_cmd(fd, std_header, cmd_fan_on,
-				head_len, cmd_len);
+	rc = send_cmd(fd, UCMD_FAN_ON);
 	if (rc)
 		goto end;
 
-	cmd_len = sizeof(cmd_init_unk3) / sizeof(cmd_init_unk3[0]);
-	rc = send_concat_cmd(fd, std_header, cmd_init_unk3,
-				head_len, cmd_len);
+	rc = send_cmd(fd, UCMD_INIT_UNK3);
 	if (rc)
 		goto end;
 
-	cmd_len = sizeof(cmd_init_led) / sizeof(cmd_init_led[0]);
-	rc = send_concat_cmd(fd, std_header, cmd_init_led,
-				head_len, cmd_len);
+	rc = send_cmd(fd, UCMD_INIT_LED);
 end:
 	if (rc)
 		ALOGE("ERROR: Cannot send init sequence\n");
@@ -345,20 +458,7 @@ end:
 int send_set_brightness(int fd, int brightness)
 {
 	int rc;
-	int head_len = sizeof(std_header) / sizeof(std_header[0]);
-	int full_sz;
-	int cmd_len;
-	uint8_t *full_cmd = NULL;
 	uint8_t conv_br = (uint8_t)((((brightness + 1) / 17) * 4) + 40);
-	uint8_t control = 45;
-
-	cmd_len = sizeof(cmd_light_lvl) / sizeof(cmd_light_lvl[0]);
-	full_cmd = __concat_cmd(std_header, cmd_light_lvl,
-				head_len, cmd_len, &full_sz);
-	if (full_cmd == NULL) {
-		ALOGE("CMDNULL!!!");
-		return -2;
-	}
 
 	/* Paranoid sanity check:
 	 * min 40, max 100 for a total of 60 steps */
@@ -369,14 +469,12 @@ int send_set_brightness(int fd, int brightness)
 
 	ALOGE("Sending brightness ori %d conv %u", brightness, conv_br);
 
-	full_cmd[head_len + 5] = conv_br;
-	full_cmd[head_len + cmd_len - 1] = conv_br + control;
-
 	/* Light setting shall reply XZ */
-	rc = sendcmd(fd, full_cmd, full_sz,
-			cmd_reply_light_ok, cmd_reply_len);
-	if (rc == 0)
+	rc = send_cmd_params(fd, UCMD_LIGHT_LVL, &conv_br, 1);
+	if (rc == 0) {
 		ucomm_cached.light = brightness;
+		ucomm_state_update(UCOMM_STATE_LIGHT, brightness);
+	}
 
 	return rc;
 }
@@ -384,14 +482,9 @@ int send_set_brightness(int fd, int brightness)
 int send_power_sequence(int fd, bool poweron)
 {
 	int rc;
-	int head_len = sizeof(std_header) / sizeof(std_header[0]);
-	int cmd_len;
 
 	if (poweron) {
-		cmd_len = sizeof(cmd_ir_sensor_on) /
-				sizeof(cmd_ir_sensor_on[0]);
-		rc = send_concat_cmd(fd, std_header, cmd_ir_sensor_on,
-					head_len, cmd_len);
+		rc = send_cmd(fd, UCMD_IR_SENSOR_ON);
 		if (rc)
 			goto end;
 
@@ -403,19 +496,14 @@ int send_power_sequence(int fd, bool poweron)
 
 		ucomm_cached.light_suspended = false;
 	} else {
-		cmd_len = sizeof(cmd_light_off) /
-				sizeof(cmd_light_off[0]);
-		rc = send_concat_cmd(fd, std_header, cmd_light_off,
-					head_len, cmd_len);
+		rc = send_cmd(fd, UCMD_LIGHT_OFF);
 		if (rc)
 			goto end;
 
 		ucomm_cached.light_suspended = true;
+		ucomm_state_update(UCOMM_STATE_LIGHT, 0);
 
-		cmd_len = sizeof(cmd_ir_sensor_off) /
-				sizeof(cmd_ir_sensor_off[0]);
-		rc = send_concat_cmd(fd, std_header, cmd_ir_sensor_off,
-					head_len, cmd_len);
+		rc = send_cmd(fd, UCMD_IR_SENSOR_OFF);
 		if (rc)
 			goto end;
 	}
@@ -429,30 +517,22 @@ end:
 
 int parse_focus_params(int fd, bool stabilized)
 {
-	int head_len = sizeof(std_header) / sizeof(std_header[0]);
-	int full_sz;
-	int cmd_len;
-	uint8_t *full_cmd = NULL;
-	uint8_t *reply = malloc(REPLY_FOCUS_CUSTOM_LEN * sizeof(uint8_t));
+	const struct ucomm_cmd_desc *desc = ucomm_cmd_get(UCMD_FOCUS_QUERY);
+	uint8_t reply[REPLY_FOCUS_CUSTOM_LEN];
 	int16_t prev_focus;
 	int rc, retry = 0;
 
-	cmd_len = sizeof(cmd_focus_query) / sizeof(cmd_focus_query[0]);
-	full_cmd = __concat_cmd(std_header, cmd_focus_query,
-					head_len, cmd_len, &full_sz);
-	if (full_cmd == NULL)
-		return -2;
 parse:
 	if (retry > 30)
 		return -1;
 
 	prev_focus = focus_state.cur_focus;
 
-	rc = sendcmd_query(fd, full_cmd, full_sz, reply, 10);
+	rc = sendcmd_query(fd, desc->frame, desc->len, reply, 10);
 	if (rc != REPLY_FOCUS_CUSTOM_LEN) {
 		if (stabilized) {
 			/* The device may be resetting focus... */
-			usleep(150000);
+			ucomm_worker_sleep(150);
 			retry++;
 			goto parse;
 		}
@@ -462,6 +542,8 @@ parse:
 	focus_state.near_max = (reply[3] << 8) | reply[4];
 	focus_state.far_max  = -(UINT_MAX - ((reply[5] << 8) | reply[6]) + 1);
 	focus_state.cur_focus = (reply[0] << 8) | reply[1];
+	ucomm_state_update(UCOMM_STATE_FOCUS, focus_state.cur_focus);
+	ucomm_state_set_focus_range(focus_state.far_max, focus_state.near_max);
 
 #ifdef DEBUG_FOCUS
 	ALOGE("Current focus: %d", focus_state.cur_focus);
@@ -477,7 +559,7 @@ parse:
 			prev_focus, focus_state.cur_focus);
 #endif
 		/* The lens is moving... let it finish */
-		usleep(1000000);
+		ucomm_worker_sleep(1000);
 
 		/* We will never hit max_retry, but let's avoid inf loops.. */
 		retry++;
@@ -489,20 +571,15 @@ parse:
 	return 0;
 }
 
-#define SHIFT24(x)	0xFFFF00 + x
-
 int send_set_focus(int fd, int target_focal)
 {
-	int head_len = sizeof(std_header) / sizeof(std_header[0]);
-	int full_sz;
-	int cmd_len;
-	int num_steps, tgt, i, rc, reply_type;
-	bool is_target_reached, go_near = false;
-	uint8_t *full_cmd = NULL;
-	uint8_t *reply = malloc(REPLY_FOCUS_CUSTOM_LEN * sizeof(uint8_t));
-	uint8_t control;
-	static int cur_proc_pass;
-	int focus_param[2];
+	int num_steps, tgt, rc, reply_type;
+	bool is_target_reached;
+	uint8_t full_cmd[UCOMM_CMD_MAX_LEN];
+	uint8_t reply[REPLY_FOCUS_CUSTOM_LEN];
+	uint8_t steps[2];
+	int len;
+	int cur_proc_pass;
 
 	/* Make sure we initialize the current processing pass at start */
 	cur_proc_pass = 0;
@@ -510,6 +587,12 @@ int send_set_focus(int fd, int target_focal)
 	ALOGI("Stepping to focal %d", target_focal);
 
 reprocess:
+	/* A newer focus request is waiting: don't waste time here */
+	if (ucomm_queue_pending(OP_FOCUS_SET)) {
+		ALOGI("Focus to %d superseded.", target_focal);
+		return ERR_UCOMM_SUPERSEDED;
+	}
+
 	/* Retrieve the current lens position */
 	rc = parse_focus_params(fd, false);
 	if (rc < 0)
@@ -518,23 +601,17 @@ reprocess:
 	/* Nothing to do? */
 	if (target_focal == focus_state.cur_focus) {
 		ALOGI("Target step reached.");
+		ucomm_cached.focus = target_focal;
 		return 0;
 	}
 
 	tgt = target_focal;
 
-	cmd_len = sizeof(cmd_focus_setpos) / sizeof(cmd_focus_setpos[0]);
-	full_cmd = __concat_cmd(std_header, cmd_focus_setpos,
-						head_len, cmd_len, &full_sz);
-	if (full_cmd == NULL)
-		return -2;
-
 	ALOGE("Target: %d  Cur: %d", tgt, focus_state.cur_focus);
 
 	/* Calculate the number of focuser steps to do */
 	if (tgt < focus_state.cur_focus) {
-		go_near = false; /* GO FAR */
-
+		/* GO FAR */
 		if (tgt < focus_state.far_max)
 			tgt = focus_state.far_max;
 
@@ -545,8 +622,7 @@ reprocess:
 		if (num_steps < -200)
 			num_steps = -200;
 	} else {
-		go_near = true; /* GO NEAR */
-
+		/* GO NEAR */
 		if (tgt > focus_state.near_max)
 			tgt = focus_state.near_max;
 
@@ -558,40 +634,33 @@ reprocess:
 			num_steps = 200;
 	}
 
-	if (go_near) {
-		/* NEAR: Number of steps */
-		full_cmd[5] = (num_steps & 0xFF00) >> 8;
-		full_cmd[6] = num_steps & 0x00FF;
-
-		/* Checksum */
-		full_cmd[9] = num_steps + FOCUS_CHECKSUM_BASE;
-	} else {
-		/* FAR: Number of steps */
-		full_cmd[5] = (num_steps & 0xFF00) >> 8;
-		full_cmd[6] = num_steps & 0x00FF;
+	/* Number of steps: negative (two's complement) to go far */
+	steps[0] = (num_steps & 0xFF00) >> 8;
+	steps[1] = num_steps & 0x00FF;
 
-		/* Checksum */
-		full_cmd[9] = SHIFT24(full_cmd[5]) + FOCUS_CHECKSUM_BASE;
-		full_cmd[9] += SHIFT24(full_cmd[6]) & 0xff;
-	}
+	len = ucomm_cmd_encode(UCMD_FOCUS_SETPOS, steps, 2,
+			       full_cmd, sizeof(full_cmd));
+	if (len < 0)
+		return -2;
 
 #ifdef DEBUG_FOCUS
 	ALOGE("num_steps = %d", num_steps);
 	ALOGE("FOC Prev: %d", focus_state.cur_focus);
 #endif
 
-	reply_type = sendcmd_query(fd, full_cmd, full_sz, reply, 0);
+	reply_type = sendcmd_query(fd, full_cmd, len, reply, 0);
 	if (reply_type == REPLY_SHORT_FOCUS_LEN ||
-	    reply_type == REPLY_FOCUS_CUSTOM_LEN)
+	    reply_type == REPLY_FOCUS_CUSTOM_LEN) {
 		focus_state.cur_focus = (reply[0] << 8) | reply[1];
-	else
+		ucomm_state_update(UCOMM_STATE_FOCUS, focus_state.cur_focus);
+	} else
 		ALOGD("Unexpected reply on set focus command.");
 
 	/* Sleep for... */
 	if (num_steps < 0)
 		num_steps *= -1;
 
-	usleep(1000 * num_steps);
+	ucomm_worker_sleep(num_steps);
 
 #ifdef DEBUG_FOCUS
 	ALOGE("FOC After: %d", focus_state.cur_focus);
@@ -619,7 +688,13 @@ reprocess:
 	}
 
 	is_target_reached = (focus_state.cur_focus == tgt);
+	if (is_target_reached)
+		ucomm_cached.focus = target_focal;
 err:
+	if (reply_type == ERR_UCOMM_FOCUS_UNDERFLOW ||
+	    reply_type == ERR_UCOMM_FOCUS_OVERFLOW)
+		ucomm_conn_notify(UCOMM_EVENT_UC_ERROR, reply_type);
+
 	if (reply_type == ERR_UCOMM_FOCUS_UNDERFLOW)
 		ALOGE("ERROR: FOCUSER UNDERFLOW!");
 	else if (reply_type == ERR_UCOMM_FOCUS_OVERFLOW)
@@ -631,7 +706,6 @@ err:
 			target_focal, focus_state.cur_focus);
 	else
 		ALOGE("Error while trying to focus.");
-	free(reply);
 
 	return rc;
 }
@@ -647,57 +721,79 @@ int send_get_focus(int fd)
 
 int set_reset_focus(int fd)
 {
-	int rc;
-	int head_len = sizeof(std_header) / sizeof(std_header[0]);
-	int full_sz;
-	int cmd_len;
-	uint8_t *full_cmd = NULL;
-
-	cmd_len = sizeof(cmd_focus_reset) / sizeof(cmd_focus_reset[0]);
-	full_cmd = __concat_cmd(std_header, cmd_focus_reset,
-				head_len, cmd_len, &full_sz);
-	if (full_cmd == NULL)
-		return -2;
+	ucomm_state_invalidate(UCOMM_STATE_FOCUS);
 
-	rc = sendcmd(fd, full_cmd, full_sz,
-			cmd_reply_nul, 0);
-
-	return rc;
+	return send_cmd(fd, UCMD_FOCUS_RESET);
 }
 
 
+/*
+ * ucomm_focus_for_range - Gets the focus step for a ToF range with
+ *			   integer arithmetic only: out of the table or
+ *			   of the fixed point evaluator, whichever is
+ *			   selected and available, then libpolyreg.
+ *			   They all give the very same step, following
+ *			   the polynomial beyond the calibrated ranges
+ *			   up to the end of the valid ToF range.
+ */
+static int ucomm_focus_for_range(int range_mm)
+{
+	int step;
+
+	if (range_mm < 0)
+		range_mm = 0;
+	else if (range_mm > FOCUS_LUT_MAX_MM)
+		range_mm = FOCUS_LUT_MAX_MM;
+
+	if (FOCUS_PREFER_FIXED && focus_fixed.valid)
+		return ucomm_focus_fixed_eval(&focus_fixed, range_mm);
+
+	if (ucomm_focus_model_step(range_mm, &step) == 0)
+		return step;
+
+	if (focus_fixed.valid)
+		return ucomm_focus_fixed_eval(&focus_fixed, range_mm);
+
+	return ucomm_focus_to_step(polyreg_f(range_mm, focus_conf.terms,
+					     FOCTBL_POLYREG_DEGREE));
+}
+
 int do_auto_focus(int fd)
 {
-	int rc, tof_score, focus_step;
-	struct micro_communicator_vl53l0 tof_data;
+	int rc, tof_conf, focus_step;
+	struct ucomm_tof_estimate tof_data;
 
 	rc = set_reset_focus(fd);
 	if (rc < 0)
 		ALOGW("Failed to reset focus!");
 
-	tof_score = ucomm_tof_thr_read_stabilized(&tof_data,
-			TOF_STABILIZATION_DEF_RUNS,
-			TOF_STABILIZATION_MATCH_NO,
-			TOF_STABILIZATION_WAIT_MS,
-			TOF_STABILIZATION_HYST_MM);
+	tof_conf = ucomm_tof_read_estimate(&tof_data,
+			TOF_ESTIMATE_SAMPLES,
+			TOF_ESTIMATE_MIN_CONFIDENCE,
+			TOF_STABILIZATION_HYST_MM,
+			TOF_ESTIMATE_TIMEOUT_MS);
 
-	ALOGE("Got tof score %d", tof_score);
+	/* On errors, the estimate was never filled in */
+	if (tof_conf < 0)
+		ALOGD("No ToF estimate: %d", tof_conf);
+	else
+		ALOGD("Got ToF estimate %dmm, confidence %d",
+			tof_data.range_mm, tof_conf);
 
 	/* If the device is not stable, do not proceed */
-	if (tof_score < 0)
+	if (tof_conf < TOF_ESTIMATE_MIN_CONFIDENCE)
 		return -4;
 
 	/* Focus reset succeeded */
 	if (rc == 0)
-		usleep(800000); // Allow the reset to finish
+		ucomm_worker_sleep(800); // Allow the reset to finish
 
 
 	rc = parse_focus_params(fd, true);
 	if (rc)
 		ALOGW("Focus is not stable!");
 
-	focus_step = (int)polyreg_f(tof_data.range_mm, focus_conf.terms,
-					FOCTBL_POLYREG_DEGREE);
+	focus_step = ucomm_focus_for_range(tof_data.range_mm);
 
 	ALOGD("Setting focus %d for %dmm", focus_step, tof_data.range_mm);
 
@@ -709,11 +805,211 @@ int do_auto_focus(int fd)
 	return send_set_focus(fd, focus_step);
 }
 
-int send_get_keystone(int fd)
+/*
+ * ucomm_cont_af_rearm - Takes the current range as the one the lens
+ *			 is focused for, after a focus change.
+ */
+static void ucomm_cont_af_rearm(void)
+{
+	struct ucomm_tof_track trk;
+	int rc = ucomm_tof_track_get(&trk, 0);
+
+	pthread_mutex_lock(&cont_af_lock);
+	cont_af.ref_valid = (rc == 0);
+	cont_af.ref_mm = trk.range_mm;
+	cont_af.out_since_us = 0;
+	pthread_mutex_unlock(&cont_af_lock);
+}
+
+/*
+ * ucomm_cont_af_set - Enables or disables the continuous AF.
+ *		       When enabled, the lens gets focused as soon as
+ *		       the range is stable, without resetting it.
+ *
+ * \return Returns zero or -ENODEV if there is no ToF assisted AF.
+ */
+static int ucomm_cont_af_set(bool enable)
 {
+	if (enable && (!tof_ready || focus_conf.terms == NULL))
+		return -ENODEV;
+
+	pthread_mutex_lock(&cont_af_lock);
+	__atomic_store_n(&cont_af.enabled, enable, __ATOMIC_RELAXED);
+	cont_af.ref_valid = false;
+	cont_af.out_since_us = 0;
+	pthread_mutex_unlock(&cont_af_lock);
+
+	ALOGI("Continuous AF %sabled", enable ? "en" : "dis");
+
 	return 0;
 }
 
+/*
+ * ucomm_cont_af_tof - ToF listener: queues a focus correction when the
+ *		       tracked range has been off the dead band for the
+ *		       dwell time. Runs on the ToF thread: never blocks
+ *		       on the uC.
+ */
+static void ucomm_cont_af_tof(
+	const struct micro_communicator_vl53l0 *sample UNUSED)
+{
+	struct ucomm_tof_track trk;
+	struct ucomm_job *job, *superseded;
+	bool queue = false;
+
+	if (!__atomic_load_n(&cont_af.enabled, __ATOMIC_RELAXED))
+		return;
+
+	if (ucomm_tof_track_get(&trk, 0) < 0)
+		return;
+
+	pthread_mutex_lock(&cont_af_lock);
+	if (!cont_af.enabled || cont_af.queued)
+		goto end;
+
+	/* Still moving or too noisy: wait for it to settle */
+	if (trk.velocity > CONT_AF_MAX_SPEED ||
+	    trk.velocity < -CONT_AF_MAX_SPEED ||
+	    trk.variance > CONT_AF_MAX_VAR) {
+		cont_af.out_since_us = 0;
+		goto end;
+	}
+
+	if (cont_af.ref_valid &&
+	    trk.range_mm < cont_af.ref_mm + CONT_AF_DEADBAND_MM &&
+	    trk.range_mm > cont_af.ref_mm - CONT_AF_DEADBAND_MM) {
+		cont_af.out_since_us = 0;
+		goto end;
+	}
+
+	if (cont_af.out_since_us == 0) {
+		cont_af.out_since_us = trk.stamp_us;
+		goto end;
+	}
+
+	if (trk.stamp_us - cont_af.out_since_us <
+	    (int64_t)CONT_AF_DWELL_MS * 1000)
+		goto end;
+
+	cont_af.queued = true;
+	queue = true;
+end:
+	pthread_mutex_unlock(&cont_af_lock);
+
+	if (!queue)
+		return;
+
+	job = ucomm_job_alloc();
+	if (job == NULL)
+		goto fail;
+
+	job->params.operation = OP_CONT_AF_STEP;
+	job->prio = UCOMM_PRIO_BACKGROUND;
+	job->coalesce = true;
+
+	if (ucomm_queue_push(job, &superseded) < 0) {
+		ucomm_job_free(job);
+		goto fail;
+	}
+
+	if (superseded)
+		ucomm_job_free(superseded);
+
+	return;
+fail:
+	pthread_mutex_lock(&cont_af_lock);
+	cont_af.queued = false;
+	pthread_mutex_unlock(&cont_af_lock);
+}
+
+/*
+ * do_cont_af_step - Moves the lens towards the focus for the tracked
+ *		     range, relative to the current position.
+ *
+ * \return Returns zero, 1 if the lens did not move or negative errno.
+ */
+static int do_cont_af_step(int fd)
+{
+	struct ucomm_tof_track trk;
+	int rc, focus_step, cur;
+	bool clamped = false;
+
+	pthread_mutex_lock(&cont_af_lock);
+	cont_af.queued = false;
+	rc = cont_af.enabled ? 0 : 1;
+	pthread_mutex_unlock(&cont_af_lock);
+	if (rc)
+		return rc;
+
+	/* Clients asking for focus go first */
+	if (ucomm_queue_pending(OP_FOCUS_SET) ||
+	    ucomm_queue_pending(OP_AUTOFOCUS))
+		return ERR_UCOMM_SUPERSEDED;
+
+	/* Lost track: the ToF thread will ask again */
+	if (ucomm_tof_track_get(&trk, 0) < 0)
+		return 1;
+
+	rc = parse_focus_params(fd, false);
+	if (rc < 0)
+		return rc;
+	cur = focus_state.cur_focus;
+
+	focus_step = ucomm_focus_for_range((int)(trk.range_mm + 0.5f));
+
+	if (focus_step < focus_state.far_max)
+		focus_step = focus_state.far_max;
+	else if (focus_step > focus_state.near_max)
+		focus_step = focus_state.near_max;
+
+	/* Small moves only: the next step will get closer */
+	if (focus_step > cur + CONT_AF_MAX_STEPS) {
+		focus_step = cur + CONT_AF_MAX_STEPS;
+		clamped = true;
+	} else if (focus_step < cur - CONT_AF_MAX_STEPS) {
+		focus_step = cur - CONT_AF_MAX_STEPS;
+		clamped = true;
+	}
+
+	ALOGD("Continuous AF: %d -> %d for %dmm",
+		cur, focus_step, (int)trk.range_mm);
+
+	if (focus_step != cur) {
+		rc = send_set_focus(fd, focus_step);
+		if (rc < 0)
+			return rc;
+	} else {
+		rc = 1;
+	}
+
+	pthread_mutex_lock(&cont_af_lock);
+	if (!clamped) {
+		cont_af.ref_valid = true;
+		cont_af.ref_mm = trk.range_mm;
+	}
+	cont_af.out_since_us = 0;
+	pthread_mutex_unlock(&cont_af_lock);
+
+	return rc;
+}
+
+/*
+ * The uC cannot report keystone: go with the last value we set, if
+ * any, or with zero like before the state cache did exist.
+ */
+int send_get_keystone(int fd UNUSED)
+{
+	if (!ucomm_cached.keystone_valid)
+		return 0;
+
+	return ucomm_cached.keystone;
+}
+
+int send_get_brightness(int fd UNUSED)
+{
+	return ucomm_cached.light_suspended ? 0 : ucomm_cached.light;
+}
+
 /*
  * Keystone control: arguments are...
  * 	   01 00 XX YY => \_/
@@ -725,47 +1021,115 @@ int send_get_keystone(int fd)
 int send_set_keystone(int fd, int ksval)
 {
 	int rc;
-	int head_len = sizeof(std_header) / sizeof(std_header[0]);
-	int full_sz;
-	int cmd_len;
-	uint8_t *full_cmd = NULL;
-	uint8_t control;
-	uint8_t final_val;
-
-	cmd_len = sizeof(cmd_keystone_val) / sizeof(cmd_keystone_val[0]);
-	full_cmd = __concat_cmd(std_header, cmd_keystone_val,
-				head_len, cmd_len, &full_sz);
-	if (full_cmd == NULL)
-		return -2;
+	uint8_t params[2];
 
 	/*
 	 * Ranges: -X to -1, 1 to X
 	 * 	0 treated as -1.
 	 */
 	if (ksval > 0) {
-		full_cmd[head_len + cmd_len - 3] = 0;
-		control = 81;
-		final_val = ksval;
+		params[0] = 0;
+		params[1] = ksval;
 	} else {
-		full_cmd[head_len + cmd_len - 3] = 1;
-		control = 82;
+		params[0] = 1;
 
 		/* ...we need an unsigned value... */
-		final_val = (uint8_t)(ksval * (-1));
+		params[1] = (uint8_t)(ksval * (-1));
 	}
 
-	full_cmd[head_len + cmd_len - 2] = final_val;
-	full_cmd[head_len + cmd_len - 1] = final_val + control;
-
 	/* Keystone shall reply XZ */
-	rc = sendcmd(fd, full_cmd, full_sz,
-			cmd_reply_light_ok, cmd_reply_len);
-	if (rc == 0)
+	rc = send_cmd_params(fd, UCMD_KEYSTONE, params, 2);
+	if (rc == 0) {
 		ucomm_cached.keystone = ksval;
+		ucomm_cached.keystone_valid = true;
+		ucomm_state_update(UCOMM_STATE_KEYSTONE, ksval);
+	}
 
 	return rc;
 }
 
+static ucomm_state_id_t ucomm_op_state(int32_t operation)
+{
+	switch (operation) {
+	case OP_BRIGHTNESS_GET:
+		return UCOMM_STATE_LIGHT;
+	case OP_FOCUS_GET:
+		return UCOMM_STATE_FOCUS;
+	case OP_KEYSTONE_GET:
+		return UCOMM_STATE_KEYSTONE;
+	default:
+		break;
+	}
+
+	return UCOMM_STATE_MAX;
+}
+
+/*
+ * ucomm_dispatch_get - Serves a getter, querying the uC only if the
+ *			cached value is older than the requested
+ *			maximum age.
+ *
+ * \param max_age_ms - Zero for any cached value, UCOMM_GET_FRESH
+ *		       to always query the uC
+ */
+static int32_t ucomm_dispatch_get(int32_t operation, int max_age_ms)
+{
+	int32_t value;
+
+	if (ucomm_state_get(ucomm_op_state(operation),
+			    max_age_ms, &value) == 0)
+		return value;
+
+	switch (operation) {
+	case OP_FOCUS_GET:
+		return send_get_focus(serport);
+	case OP_KEYSTONE_GET:
+		return send_get_keystone(serport);
+	case OP_BRIGHTNESS_GET:
+		return send_get_brightness(serport);
+	default:
+		break;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * ucomm_dispatch_notify - Tells the subscribed clients about the
+ *			   outcome of a state changing operation.
+ */
+static void ucomm_dispatch_notify(int32_t operation, int32_t rc)
+{
+	switch (operation) {
+	case OP_POWER:
+	case OP_BRIGHTNESS:
+		if (rc == 0)
+			ucomm_conn_notify(UCOMM_EVENT_BRIGHTNESS,
+					  send_get_brightness(serport));
+		break;
+	case OP_KEYSTONE_SET:
+		if (rc == 0)
+			ucomm_conn_notify(UCOMM_EVENT_KEYSTONE,
+					  ucomm_cached.keystone);
+		break;
+	case OP_FOCUS_SET:
+	case OP_AUTOFOCUS:
+	case OP_CONT_AF_STEP:
+		/* The newer request will tell */
+		if (rc == ERR_UCOMM_SUPERSEDED)
+			break;
+
+		if (rc < 0)
+			ucomm_conn_notify(UCOMM_EVENT_FOCUS_FAILED, rc);
+		else
+			ucomm_conn_notify(UCOMM_EVENT_FOCUS_DONE,
+					  focus_state.cur_focus);
+		break;
+	default:
+		break;
+	}
+}
+
 /*
  * ucomm_dispatch - Recognizes the requested operation and calls
  *		    the appropriate function to dispatch the
@@ -777,6 +1141,7 @@ static int32_t ucomm_dispatch(struct micro_communicator_params *params)
 {
 	int32_t rc;
 	int val = params->value;
+	bool changed = true;
 
 	switch (params->operation) {
 	case OP_INITIALIZE:
@@ -791,82 +1156,528 @@ static int32_t ucomm_dispatch(struct micro_communicator_params *params)
 		 * If the last time we've run the power off sequence, then
 		 * we have to run the power on sequence.
 		 */
-		if (ucomm_cached.light_suspended || val == 0)
+		if (ucomm_cached.light_suspended || val == 0) {
 			rc = send_power_sequence(serport, val ? true : false);
-		else
+		} else if (ucomm_state_matches(UCOMM_STATE_LIGHT, val)) {
+			rc = 0;
+			changed = false;
+		} else {
 			rc = send_set_brightness(serport, val);
+		}
 		break;
 	case OP_FOCUS_SET:
-		rc = send_set_focus(serport, val);
+		/* Already there? */
+		if (ucomm_state_matches(UCOMM_STATE_FOCUS, val)) {
+			rc = 0;
+			changed = false;
+		} else {
+			rc = send_set_focus(serport, val);
+		}
 		break;
 	case OP_KEYSTONE_SET:
-		rc = send_set_keystone(serport, val);
+		if (ucomm_state_matches(UCOMM_STATE_KEYSTONE, val)) {
+			rc = 0;
+			changed = false;
+		} else {
+			rc = send_set_keystone(serport, val);
+		}
 		break;
 	case OP_FOCUS_GET:
-		rc = send_get_focus(serport);
-		break;
 	case OP_KEYSTONE_GET:
-		rc = send_get_keystone(serport);
+	case OP_BRIGHTNESS_GET:
+		rc = ucomm_dispatch_get(params->operation, val);
 		break;
 	case OP_AUTOFOCUS:
 		rc = do_auto_focus(serport);
 		break;
 	case OP_CONT_AF_SET:
+		rc = ucomm_cont_af_set(val ? true : false);
+		changed = false;
+		break;
+	case OP_CONT_AF_STEP:
+		rc = do_cont_af_step(serport);
+		if (rc > 0) {
+			rc = 0;
+			changed = false;
+		}
+		break;
+	case OP_BATCH:
+	case OP_SUBSCRIBE:
 	default:
 		ALOGE("Invalid operation requested.");
 		rc = -2;
 	}
 
+	if (changed)
+		ucomm_dispatch_notify(params->operation, rc);
+
+	/* Continuous AF shall not undo what the client asked for */
+	if (rc == 0 && (params->operation == OP_FOCUS_SET ||
+			params->operation == OP_AUTOFOCUS))
+		ucomm_cont_af_rearm();
+
 	return rc;
 }
 
-static void *ucommsvr_looper(void *unusedvar UNUSED)
+/*
+ * ucomm_op_prio - Gets the priority class of an operation: interactive
+ *		   adjustments go ahead of everything else, queries and
+ *		   long running focus operations go last.
+ */
+static ucomm_prio_t ucomm_op_prio(int32_t operation)
+{
+	switch (operation) {
+	case OP_POWER:
+	case OP_BRIGHTNESS:
+	case OP_KEYSTONE_SET:
+	case OP_CONT_AF_SET:
+		return UCOMM_PRIO_INTERACTIVE;
+	case OP_INITIALIZE:
+	case OP_FOCUS_SET:
+		return UCOMM_PRIO_NORMAL;
+	default:
+		break;
+	}
+
+	return UCOMM_PRIO_BACKGROUND;
+}
+
+/*
+ * ucomm_op_coalesce - Set operations where only the latest value
+ *		       matters: pending requests collapse to the newest.
+ */
+static bool ucomm_op_coalesce(int32_t operation)
+{
+	return (operation == OP_BRIGHTNESS ||
+		operation == OP_KEYSTONE_SET ||
+		operation == OP_FOCUS_SET);
+}
+
+/*
+ * ucomm_send_reply - Sends n results to a client, preceded by the
+ *		      request tag if the request was a tagged one.
+ *
+ * \return Returns the sent size or negative errno.
+ */
+static int ucomm_send_reply(struct ucomm_conn *conn, bool tagged,
+			    uint32_t tag, const int32_t *results, int n)
+{
+	struct micro_communicator_reply reply;
+
+	if (!tagged)
+		return ucomm_conn_send(conn, results, sizeof(int32_t) * n);
+
+	reply.tag = tag;
+	memcpy(reply.results, results, sizeof(int32_t) * n);
+
+	return ucomm_conn_send(conn, &reply, UCOMM_REPLY_SZ(n));
+}
+
+/*
+ * ucomm_job_reply - Sends the job result to its client and drops the
+ *		     job's reference to the connection, which stays
+ *		     open for further requests.
+ */
+static void ucomm_job_reply(struct ucomm_job *job)
+{
+	int i, ret, retry = 0;
+
+	if (job->conn == NULL)
+		return;
+
+	if (job->params.operation != OP_BATCH) {
+		job->nops = 1;
+		job->results[0] = job->result;
+	} else if (job->result != 0) {
+		/* A superseded or refused batch fails as a whole */
+		for (i = 0; i < job->nops; i++)
+			job->results[i] = job->result;
+	}
+
+	do {
+		ret = ucomm_send_reply(job->conn, job->tagged, job->tag,
+				       job->results, job->nops);
+		if (ret >= 0 || ret == -ENOTCONN || ret == -EPIPE)
+			break;
+		for (i = 0; i < job->nops; i++)
+			job->results[i] = -EINVAL;
+	} while (++retry < 50);
+
+	if (ret < 0)
+		ALOGE("ERROR: Cannot send reply!!!");
+
+	ucomm_conn_put(job->conn);
+	job->conn = NULL;
+}
+
+/*
+ * ucomm_run_batch - Executes the batch operations in order.
+ *		     On stop-on-error, the ones after the first
+ *		     failure are not executed and get -ECANCELED.
+ */
+static void ucomm_run_batch(struct ucomm_job *job)
+{
+	bool stop = false;
+	int i;
+
+	for (i = 0; i < job->nops; i++) {
+		if (stop) {
+			job->results[i] = -ECANCELED;
+			continue;
+		}
+
+		job->results[i] = ucomm_dispatch(&job->ops[i]);
+		if (job->results[i] < 0 &&
+		    (job->batch_flags & UCOMM_BATCH_STOP_ON_ERROR))
+			stop = true;
+	}
+
+	job->result = 0;
+}
+
+static void ucomm_run_job(struct ucomm_job *job)
+{
+	ucomm_prio_t prev_prio = ucomm_cur_prio;
+
+	ucomm_cur_prio = job->prio;
+	if (job->params.operation == OP_BATCH)
+		ucomm_run_batch(job);
+	else
+		job->result = ucomm_dispatch(&job->params);
+	ucomm_cur_prio = prev_prio;
+
+	ucomm_job_reply(job);
+	ucomm_job_free(job);
+}
+
+/*
+ * ucomm_worker_sleep - Waits for the uC to carry out a long operation.
+ *			Interactive jobs queued in the meanwhile are
+ *			served right away, so that a long focus move
+ *			gets split in segments instead of stalling
+ *			every other client.
+ */
+static void ucomm_worker_sleep(int ms)
+{
+	struct ucomm_job *job;
+	int64_t deadline = uart_now_ms() + ms;
+	int remain;
+
+	/* Interactive jobs never get preempted */
+	if (ucomm_cur_prio <= UCOMM_PRIO_INTERACTIVE) {
+		usleep(ms * 1000);
+		return;
+	}
+
+	while ((remain = (int)(deadline - uart_now_ms())) > 0) {
+		job = ucomm_queue_pop(UCOMM_PRIO_INTERACTIVE + 1, remain);
+		if (job != NULL) {
+			ucomm_run_job(job);
+			continue;
+		}
+
+		/* Shutting down: just wait out the remaining time */
+		if (!ucthread_run) {
+			usleep(remain * 1000);
+			break;
+		}
+	}
+}
+
+/*
+ * ucomm_uart_thread - Owns the serial port and executes the queued
+ *		       jobs, most urgent first.
+ */
+static void *ucomm_uart_thread(void *unusedvar UNUSED)
+{
+	struct ucomm_job *job;
+
+	ALOGI("MicroComm UART thread started");
+
+	while (ucthread_run) {
+		job = ucomm_queue_pop(UCOMM_PRIO_MAX, -1);
+		if (job == NULL)
+			continue;
+
+		ucomm_run_job(job);
+	}
+
+	ALOGI("MicroComm UART thread terminated.");
+	pthread_exit((void*)((int)0));
+}
+
+/* Fails a request without queueing it */
+static void ucomm_reply_now(struct ucomm_conn *conn, bool tagged,
+			    uint32_t tag, int32_t result, int n)
 {
+	int32_t results[UCOMM_BATCH_MAX_OPS];
+	int i;
+
+	for (i = 0; i < n; i++)
+		results[i] = result;
+
+	if (ucomm_send_reply(conn, tagged, tag, results, n) < 0)
+		ALOGE("ERROR: Cannot send reply!!!");
+}
+
+/*
+ * ucomm_client_queue - Queues a job for a request received from a
+ *			client. The job holds a reference to the
+ *			connection until the UART thread has replied.
+ */
+static void ucomm_client_queue(struct ucomm_conn *conn,
+			       struct ucomm_job *job)
+{
+	struct ucomm_job *superseded;
+
+	job->conn = conn;
+	ucomm_conn_get(conn);
+
+	if (ucomm_queue_push(job, &superseded) < 0) {
+		ucomm_conn_put(conn);
+		job->conn = NULL;
+		ucomm_job_free(job);
+		return;
+	}
+
+	/* The older request never reached the uC */
+	if (superseded) {
+		superseded->result = ERR_UCOMM_SUPERSEDED;
+		ucomm_job_reply(superseded);
+		ucomm_job_free(superseded);
+	}
+}
+
+static void ucomm_client_request(struct ucomm_conn *conn,
+				 struct micro_communicator_params *params,
+				 bool tagged, uint32_t tag)
+{
+	struct ucomm_job *job;
+	int32_t value;
+
+	if (params->operation >= OP_INTERNAL_BASE) {
+		ucomm_reply_now(conn, tagged, tag, -EINVAL, 1);
+		return;
+	}
+
+	/* Subscriptions concern the connection only */
+	if (params->operation == OP_SUBSCRIBE) {
+		ucomm_conn_subscribe(conn, (uint32_t)params->value);
+		ucomm_reply_now(conn, tagged, tag, 0, 1);
+		return;
+	}
+
+	/* Cached getters never wait behind the UART thread */
+	if (ucomm_state_get(ucomm_op_state(params->operation),
+			    params->value, &value) == 0) {
+		ucomm_reply_now(conn, tagged, tag, value, 1);
+		return;
+	}
+
+	job = ucomm_job_alloc();
+	if (job == NULL) {
+		ALOGE("Too many requests in flight!");
+		ucomm_reply_now(conn, tagged, tag, -EBUSY, 1);
+		return;
+	}
+
+	job->params = *params;
+	job->tagged = tagged;
+	job->tag = tag;
+	job->prio = ucomm_op_prio(params->operation);
+	job->coalesce = ucomm_op_coalesce(params->operation);
+
+	ucomm_client_queue(conn, job);
+}
+
+/*
+ * ucomm_client_batch - Queues a batch as a single job, so that its
+ *			operations run back to back, at the priority
+ *			of the least urgent one: a batch carrying a focus
+ *			operation must never run as interactive, as that
+ *			would nest it in ucomm_worker_sleep() in the middle
+ *			of another focus move.
+ */
+static void ucomm_client_batch(struct ucomm_conn *conn,
+			       struct micro_communicator_batch *batch,
+			       int len)
+{
+	struct ucomm_job *job;
+	bool tagged;
+	uint32_t i;
+
+	if (len < (int)UCOMM_BATCH_HDR_SZ || batch->count == 0 ||
+	    batch->count > UCOMM_BATCH_MAX_OPS ||
+	    len != (int)UCOMM_BATCH_SZ(batch->count)) {
+		ALOGE("Malformed batch request!!");
+		ucomm_reply_now(conn, false, 0, -EINVAL, 1);
+		return;
+	}
+	tagged = !!(batch->flags & UCOMM_BATCH_TAGGED);
+
+	job = ucomm_job_alloc();
+	if (job == NULL) {
+		ALOGE("Too many requests in flight!");
+		ucomm_reply_now(conn, tagged, batch->tag, -EBUSY,
+				batch->count);
+		return;
+	}
+
+	job->params.operation = OP_BATCH;
+	job->params.value = 0;
+	job->tagged = tagged;
+	job->tag = batch->tag;
+	job->batch_flags = batch->flags;
+	job->nops = batch->count;
+	job->prio = UCOMM_PRIO_INTERACTIVE;
+	for (i = 0; i < batch->count; i++) {
+		if (batch->ops[i].operation >= OP_INTERNAL_BASE) {
+			ucomm_reply_now(conn, tagged, batch->tag, -EINVAL,
+					batch->count);
+			ucomm_job_free(job);
+			return;
+		}
+
+		job->ops[i] = batch->ops[i];
+		if (ucomm_op_prio(batch->ops[i].operation) > job->prio)
+			job->prio = ucomm_op_prio(batch->ops[i].operation);
+	}
+
+	ucomm_client_queue(conn, job);
+}
+
+/*
+ * ucomm_client_read - Reads all the requests pending on a connection.
+ *
+ * \return Returns zero or negative errno if the client is gone.
+ */
+static int ucomm_client_read(struct ucomm_conn *conn)
+{
+	union {
+		struct micro_communicator_params params;
+		struct micro_communicator_tagged_params tagged;
+		struct micro_communicator_batch batch;
+	} msg;
 	int ret;
-	int32_t microcomm_reply = -EINVAL;
-	uint8_t retry;
-	socklen_t clientlen = sizeof(struct sockaddr_un);
-	struct sockaddr_un client_addr;
-	struct micro_communicator_params extparams;
-
-reloop:
-	ALOGI("MicroComm Server is waiting for connection...");
-	if (clientsock)
-		close(clientsock);
-	retry = 0;
-	while (((clientsock = accept(sock, (struct sockaddr*)&client_addr,
-		&clientlen)) > 0) && (ucthread_run == true))
-	{
-		ret = recv(clientsock, &extparams,
-			sizeof(struct micro_communicator_params), 0);
-		if (!ret) {
-			ALOGE("Cannot receive data from client");
-			goto reloop;
+
+	while (1) {
+		ret = recv(conn->fd, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -errno;
+		}
+
+		/* Orderly shutdown from the peer */
+		if (ret == 0)
+			return -ENOTCONN;
+
+		if (ret >= (int)sizeof(int32_t) &&
+		    msg.params.operation == OP_BATCH) {
+			ucomm_client_batch(conn, &msg.batch, ret);
+			continue;
 		}
 
-		if (ret != sizeof(struct micro_communicator_params)) {
+		if (ret == sizeof(msg.tagged)) {
+			ucomm_client_request(conn, &msg.params,
+					     true, msg.tagged.tag);
+			continue;
+		}
+
+		if (ret != sizeof(msg.params)) {
 			ALOGE("Received data size mismatch!!");
-			goto reloop;
-		} else ret = 0;
+			ucomm_reply_now(conn, false, 0, -EINVAL, 1);
+			continue;
+		}
 
-		microcomm_reply = ucomm_dispatch(&extparams);
+		ucomm_client_request(conn, &msg.params, false, 0);
+	}
+}
 
-retry_send:
-		retry++;
-		ret = send(clientsock, &microcomm_reply,
-			sizeof(microcomm_reply), 0);
-		if (ret == -1) {
-			microcomm_reply = -EINVAL;
-			if (retry < 50)
-				goto retry_send;
-			ALOGE("ERROR: Cannot send reply!!!");
-			goto reloop;
-		} else retry = 0;
-
-		if (clientsock)
-			close(clientsock);
+static void ucomm_client_accept(void)
+{
+	struct epoll_event ev;
+	struct ucomm_conn *conn;
+	int fd;
+
+	fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			ALOGE("Cannot accept client: %d", errno);
+		return;
+	}
+
+	conn = ucomm_conn_add(fd);
+	if (conn == NULL) {
+		ALOGE("Too many clients connected!");
+		close(fd);
+		return;
+	}
+
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = conn;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		ALOGE("Cannot watch client socket");
+		ucomm_conn_hangup(conn);
 	}
+}
 
+/*
+ * ucommsvr_looper - Accepts clients and reads their requests: every
+ *		     connection stays open until the client closes it,
+ *		     so that a client can send any number of requests.
+ */
+static void *ucommsvr_looper(void *unusedvar UNUSED)
+{
+	struct epoll_event events[UCOMMSERVER_MAXCLIENTS];
+	struct epoll_event ev;
+	struct ucomm_conn *conn;
+	int i, nev, ret;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	ret = epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+	if (ret < 0) {
+		ALOGE("Cannot watch the server socket");
+		goto end;
+	}
+
+	ALOGI("MicroComm Server is waiting for connections...");
+	while (ucthread_run) {
+		nev = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("Cannot wait for clients: %d", errno);
+			break;
+		}
+
+		for (i = 0; i < nev && ucthread_run; i++) {
+			conn = events[i].data.ptr;
+
+			/* The server socket is the only one without conn */
+			if (conn == NULL) {
+				ucomm_client_accept();
+				continue;
+			}
+
+			ret = 0;
+			if (events[i].events & EPOLLOUT)
+				ret = ucomm_conn_flush(conn);
+			if (ret == 0 && (events[i].events & EPOLLIN))
+				ret = ucomm_client_read(conn);
+
+			if (ret < 0 || (events[i].events &
+				(EPOLLHUP | EPOLLRDHUP | EPOLLERR))) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+				ucomm_conn_hangup(conn);
+			}
+		}
+	}
+
+end:
 	ALOGI("MicroComm Server terminated.");
 	pthread_exit((void*)((int)0));
 }
@@ -878,13 +1689,12 @@ static int manage_ucommsvr(bool start)
 
 	if (start == false) {
 		ucthread_run = false;
-		if (clientsock) {
-			shutdown(clientsock, SHUT_RDWR);
-			close(clientsock);
-		}
+		ucomm_queue_shutdown();
+		ucomm_conn_hangup_all();
 		if (sock) {
 			shutdown(sock, SHUT_RDWR);
 			close(sock);
+			sock = 0;
 		}
 
 		return 0;
@@ -892,6 +1702,28 @@ static int manage_ucommsvr(bool start)
 
 	ucthread_run = true;
 
+	/*
+	 * Connections outlive a looper restart, as queued jobs still
+	 * hold references to them: the table and the epoll instance
+	 * watching the client sockets get set up only once.
+	 */
+	if (epfd < 0) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0) {
+			ALOGE("Cannot create the epoll instance");
+			return -errno;
+		}
+
+		ucomm_conn_init(epfd);
+	}
+
+	/* Restarting: drop the listening socket of the previous looper */
+	if (sock) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, sock, NULL);
+		close(sock);
+		sock = 0;
+	}
+
 	/* Create folder, if doesn't exist */
 	if (stat(UCOMMSERVER_DIR, &st) == -1) {
 		mkdir(UCOMMSERVER_DIR, 0773);
@@ -950,7 +1782,7 @@ static int manage_ucommsvr(bool start)
  */
 static int ucomm_autofocus_get_coeff(void)
 {
-	int i;
+	int i, rc;
 	struct pair_data *pairs;
 	double coeff;
 	int rs = 3 * FOCTBL_POLYREG_DEGREE;
@@ -994,6 +1826,20 @@ static int ucomm_autofocus_get_coeff(void)
 
 	ALOGD("Correlation coefficient: %.10f", coeff);
 
+	rc = ucomm_focus_fixed_init(&focus_fixed, focus_conf.terms,
+				    FOCTBL_POLYREG_DEGREE);
+	if (rc < 0)
+		ALOGW("Fixed point focus model unusable: %d", rc);
+
+	/* No need for the table, unless the fixed point model failed */
+	if (FOCUS_PREFER_FIXED && focus_fixed.valid)
+		goto end;
+
+	rc = ucomm_focus_model_build(focus_conf.terms, FOCTBL_POLYREG_DEGREE);
+	if (rc < 0)
+		ALOGW("No focus table: AF will evaluate the polynomial");
+
+end:
 	ALOGI("Auto-Focus Polynomial Regression coordinates loaded.");
 
 	return 0;
@@ -1034,6 +1880,7 @@ int main(void)
 
 	/* Flush the comms */
 	tcflush(serport, TCIFLUSH);
+	ucomm_frame_decoder_reset(&uart_dec);
 
 	/* Send configuration to kernel */
 	if (tcsetattr(serport, TCSADRAIN, &tty) != 0) {
@@ -1042,10 +1889,15 @@ int main(void)
 		goto err;
 	}
 
+	rc = ucomm_state_init();
+	if (rc < 0)
+		ALOGW("No state page: clients will have to ask for state");
+
 	/* Fill in cached data with safe values */
 	ucomm_cached.light_suspended = false;
 	ucomm_cached.light = 100;
 	ucomm_cached.keystone = 86;
+	ucomm_cached.keystone_valid = false;
 	ucomm_cached.focus = 129;
 
 	rc = parse_ucomm_xml_data(UCOMMSERVER_CONF_FILE, "tof_focus",
@@ -1053,12 +1905,28 @@ int main(void)
 	if (rc < 0) {
 		ALOGE("Cannot parse configuration for ToF assisted AF");
 	} else {
+		ucomm_tof_set_listener(ucomm_cont_af_tof);
+
 		rc = ucomm_input_tof_init();
 		if (rc < 0)
 			ALOGW("Cannot open ToF. Ranging will be unavailable");
+		else
+			tof_ready = true;
 		ucomm_autofocus_get_coeff();
 	}
 	
+	rc = ucomm_queue_init();
+	if (rc < 0)
+		goto err;
+
+	rc = pthread_create(&ucomm_uart_pthread, NULL,
+			    ucomm_uart_thread, NULL);
+	if (rc != 0) {
+		ALOGE("Cannot create MicroComm UART thread");
+		rc = -ENXIO;
+		goto err;
+	}
+
 start:
 	/* All devices opened and configured. Start! */
 	rc = manage_ucommsvr(true);
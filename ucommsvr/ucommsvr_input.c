@@ -22,12 +22,16 @@
 //#include <errno.h>
 #include <sys/poll.h>
 #include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <dirent.h>
 #include <dlfcn.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -36,7 +40,9 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <time.h>
 #include <linux/input.h>
 
 #include <private/android_filesystem_config.h>
@@ -45,6 +51,8 @@
 #include "ucomm_private.h"
 #include "ucomm_input.h"
 #include "ucomm_ext.h"
+#include "ucomm_seqlock.h"
+#include "ucomm_state.h"
 
 #define LOG_TAG			"MicroCommInput"
 
@@ -53,15 +61,14 @@
 #define VL53L0_HIGH_RANGE	"1"
 #define VL53L0_HIGH_ACCURACY	"2"
 
-#define ITERATE_MAX_DEVS	9
+#define DEVFS_INPUT_DIR		"/dev/input"
 
-#define SYSFS_INPUT_STR		"/sys/class/input/input%d"
-#define DEVFS_INPUT_STR		"/dev/input/event%d"
+/* Attributes of the driver behind an event node */
+#define SYSFS_EVDEV_STR		"/sys/class/input/event%d/device"
+#define SYSFS_PATH_LEN		64
 
-static const char inputdev_name[] = "STM VL53L0 proximity sensor";
-static const char sysfs_input_str[] = "/sys/class/input/input";
-static const char devfs_input_str[] = "/dev/input/event";
-static int stmvl_fd;
+static int stmvl_fd = -1;
+static int stmvl_evtno = -1;
 
 
 
@@ -72,33 +79,93 @@ enum {
 
 static bool ucithread_run[THREAD_MAX];
 static pthread_t uci_pthreads[THREAD_MAX];
-static int inotof_fd;
-static struct inotify_tof *inotof;
+/* Watches DEVFS_INPUT_DIR, for the sensor to come and go */
+static int inotof_fd = -1;
 static struct pollfd uci_pfds[FD_MAX];
 static struct epoll_event uci_pollevt[FD_MAX];
 static int uci_pollfd[FD_MAX];
 static int uci_pfdelay_ms[FD_MAX];
-static char *uci_tof_enable_path;
+
+/*
+ * Attach state: changed by the ToF thread on hotplug, read by the
+ * AF paths on other threads. The enable path is protected by
+ * tof_wait_lock, the flag and the clock are accessed atomically.
+ */
+static char uci_tof_enable_path[SYSFS_PATH_LEN];
 static bool tof_enabled = false;
 
-struct micro_communicator_vl53l0 stmvl_status;
+/*
+ * Latest ToF samples, written by the ToF thread only and read
+ * locklessly by everybody else. Every slot is protected by its own
+ * seqlock (see ucomm_seqlock.h) and remembers the number of the
+ * sample it holds, so that readers can tell if it got overwritten.
+ * tof_ring_head is the number of the newest sample, zero for none.
+ */
+static struct {
+	uint32_t seq;
+	uint32_t id;
+	struct micro_communicator_vl53l0 sample;
+} tof_ring[TOF_RING_SIZE];
+static uint32_t tof_ring_head;
 
-#define UNUSED __attribute__((unused))
+/* Clock of the input events timestamps */
+static clockid_t tof_clock = CLOCK_REALTIME;
+
+/*
+ * Constant velocity Kalman filter over the range, run by the ToF
+ * thread only: state is range and velocity, with their covariance.
+ * The result is published to the readers through tof_track_pub.
+ */
+static struct {
+	bool valid;
+	float x[2];
+	float p[2][2];
+	int64_t stamp_us;
+} tof_kf;
+
+static struct {
+	uint32_t seq;
+	bool valid;
+	float x[2];
+	float p[2][2];
+	int64_t stamp_us;
+} tof_track_pub;
 
-#define LEN_NAME	4
-#define LEN_ENAB	16
-#define LEN_MODE	12
+/*
+ * Sample being assembled out of the input events, ToF thread only.
+ * Values not reported in a SYN_REPORT did not change.
+ */
+static struct micro_communicator_vl53l0 tof_cur;
+static bool tof_syn_dropped;
 
-int ucomm_tof_enable(bool enable)
+/* Gets every new sample, on the ToF thread */
+static ucomm_tof_listener_t tof_listener;
+
+/* Signaled by the ToF thread on every complete report */
+static pthread_mutex_t tof_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tof_wait_cond;
+
+#define UNUSED __attribute__((unused))
+
+/*
+ * __ucomm_tof_enable - Switches the sensor on or off, without waiting
+ *			for it to settle.
+ */
+static int __ucomm_tof_enable(bool enable)
 {
+	char path[SYSFS_PATH_LEN];
 	int fd, rc;
 
-	if (uci_tof_enable_path == NULL)
+	pthread_mutex_lock(&tof_wait_lock);
+	memcpy(path, uci_tof_enable_path, sizeof(path));
+	pthread_mutex_unlock(&tof_wait_lock);
+
+	if (path[0] == '\0')
 		return -1;
 
-	fd = open(uci_tof_enable_path, O_WRONLY | O_SYNC);
+	fd = open(path, O_WRONLY | O_SYNC);
 	if (fd < 0) {
-		ALOGD("Cannot open %s", uci_tof_enable_path);
+		ALOGD("Cannot open %s", path);
 		return 1;
 	}
 
@@ -115,26 +182,33 @@ int ucomm_tof_enable(bool enable)
 end:
 	fsync(fd);
 	close(fd);
+	__atomic_store_n(&tof_enabled, enable, __ATOMIC_RELEASE);
+
+	return rc;
+}
+
+int ucomm_tof_enable(bool enable)
+{
+	int rc = __ucomm_tof_enable(enable);
+
 	usleep(100000);
-	tof_enabled = enable;
 
 	return rc;
 }
 
-static int ucomm_tof_sys_init(bool high_accuracy, int devno, int plen)
+static int ucomm_tof_sys_init(bool high_accuracy, int evtno)
 {
-	char* sns_mode_path;
+	char sns_mode_path[SYSFS_PATH_LEN];
 	int fd, rc;
 	struct passwd *pwd;
 	struct passwd *grp;
 	uid_t uid;
 	gid_t gid;
 
-	uci_tof_enable_path = (char*)calloc(plen + LEN_ENAB, sizeof(char));
-	if (uci_tof_enable_path == NULL) {
-		ALOGE("Memory exhausted. Cannot allocate.");
-		return -3;
-	}
+	pthread_mutex_lock(&tof_wait_lock);
+	snprintf(uci_tof_enable_path, SYSFS_PATH_LEN,
+			SYSFS_EVDEV_STR "/enable_ps_sensor", evtno);
+	pthread_mutex_unlock(&tof_wait_lock);
 
 	pwd = getpwnam("system");
 	if (pwd == NULL) {
@@ -152,8 +226,14 @@ static int ucomm_tof_sys_init(bool high_accuracy, int devno, int plen)
 
 	gid = grp->pw_gid;
 
-	snprintf(uci_tof_enable_path, plen + LEN_ENAB,
-			"%s%d/enable_ps_sensor", sysfs_input_str, devno);
+	/*
+	 * Root privileges get dropped after the first attach: a sensor
+	 * coming back later keeps the permissions the driver gives it.
+	 */
+	if (getuid() != 0) {
+		ALOGW("Not root anymore: cannot set ToF permissions");
+		return 1;
+	}
 
 	if (chown(uci_tof_enable_path, uid, gid) == -1) {
 		ALOGD("Cannot chown %s", uci_tof_enable_path);
@@ -161,22 +241,14 @@ static int ucomm_tof_sys_init(bool high_accuracy, int devno, int plen)
 	}
 
 	if (high_accuracy) {
-		sns_mode_path = (char*)calloc(plen + LEN_MODE, sizeof(char));
-		if (sns_mode_path == NULL) {
-			ALOGE("Memory exhausted. Cannot allocate.");
-			free(uci_tof_enable_path);
-			return -3;
-		}
-
-		snprintf(sns_mode_path, plen + LEN_MODE,
-			"%s%d/set_use_case", sysfs_input_str, devno);
+		snprintf(sns_mode_path, sizeof(sns_mode_path),
+			SYSFS_EVDEV_STR "/set_use_case", evtno);
 
 		if (chown(sns_mode_path, uid, gid) == -1) {
-			ALOGD("Cannot chown %s/enable_ps_sensor", sns_mode_path);
+			ALOGD("Cannot chown %s", sns_mode_path);
 			return 1;
 		}
 
-
 		fd = open(sns_mode_path, O_WRONLY);
 		if (fd < 0) {
 			ALOGD("Cannot open %s", sns_mode_path);
@@ -199,337 +271,761 @@ static int ucomm_tof_sys_init(bool high_accuracy, int devno, int plen)
 	return 0;
 }
 
-/* TODO: Use IOCTL EVIOCGNAME as a waaaay better way */
-static int ucomm_find_inputdev(int maxdevs, int idev_len, char* idev_name)
+#define BITS_PER_LONG		(sizeof(unsigned long) * 8)
+#define BITS_TO_LONGS(x)	(((x) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline bool test_evbit(const unsigned long *bits, int bit)
 {
-	int fd, plen, rlen, vlen, rc, i;
-	int plen_xtra = 3;
-	bool found = false;
-	char buf[254];
-	char* path;
+	return !!(bits[bit / BITS_PER_LONG] & (1UL << (bit % BITS_PER_LONG)));
+}
 
-	/*
-	 * Avoid checking more than 99 input devices,
-	 * because... really? :)
-	 */
-	if (maxdevs > 99)
-		return -1;
+/*
+ * ucomm_inputdev_match - Checks if an event device has the wanted name
+ *			  and reports ranging events.
+ */
+static bool ucomm_inputdev_match(int fd, const char *idev_name)
+{
+	unsigned long evbits[BITS_TO_LONGS(EV_CNT)] = { 0 };
+	unsigned long absbits[BITS_TO_LONGS(ABS_CNT)] = { 0 };
+	char name[128];
+	int rc;
 
-	if (maxdevs > 9)
-		plen_xtra++;
+	rc = ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+	if (rc < 0)
+		return false;
+	name[rc < (int)sizeof(name) ? rc : (int)sizeof(name) - 1] = '\0';
 
-	plen = strlen(sysfs_input_str) + plen_xtra;
-	path = (char*) calloc(plen + LEN_NAME, sizeof(char));
-	if (path == NULL) {
-		ALOGE("Out of memory. Cannot allocate.");
-		rc = -1;
-		goto end;
+	if (strcmp(name, idev_name) != 0)
+		return false;
+
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(evbits)), evbits) < 0 ||
+	    !test_evbit(evbits, EV_ABS))
+		return false;
+
+	if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absbits)), absbits) < 0)
+		return false;
+
+	return test_evbit(absbits, ABS_DISTANCE) &&
+		test_evbit(absbits, ABS_HAT1X);
+}
+
+/*
+ * ucomm_open_inputdev - Opens an event node if it is the wanted device.
+ *
+ * \return Returns the opened event device fd or negative errno.
+ */
+static int ucomm_open_inputdev(const char *node, const char *idev_name)
+{
+	char path[sizeof(DEVFS_INPUT_DIR) + NAME_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), DEVFS_INPUT_DIR "/%s", node);
+
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		ALOGD("Cannot open %s", path);
+		return -errno;
 	}
 
-	for (i = 0; i <= maxdevs; i++) {
-		rc = snprintf(path, plen + LEN_NAME, "%s%d/name",
-							sysfs_input_str, i);
+	if (!ucomm_inputdev_match(fd, idev_name)) {
+		close(fd);
+		return -ENODEV;
+	}
 
-		if (fd > 0)
-			close(fd);
+	ALOGI("Found %s at %s", idev_name, path);
 
-		fd = open(path, (O_RDONLY | O_NONBLOCK));
-		if (fd < 0) {
-			ALOGD("Cannot open %s", path);
-			continue;
-		}
+	return fd;
+}
 
-		rlen = read(fd, buf, idev_len);
-		if (!rlen)
-			continue;
+/*
+ * ucomm_find_inputdev - Looks for an input device among all the event
+ *			 nodes, by name and capabilities.
+ *
+ * \param idev_name - Name reported by the input device driver
+ * \param evtno - Number of the found event node
+ *
+ * \return Returns the opened event device fd or negative errno.
+ */
+static int ucomm_find_inputdev(const char *idev_name, int *evtno)
+{
+	struct dirent *de;
+	DIR *dir;
+	int fd = -ENODEV;
+
+	dir = opendir(DEVFS_INPUT_DIR);
+	if (dir == NULL) {
+		ALOGE("Cannot open %s", DEVFS_INPUT_DIR);
+		return -errno;
+	}
 
-		/*
-		 * If the string length doesn't match, avoid doing
-		 * expensive stuff, as the string cannot be the same.
-		 * Also consider some mistakes and compare it with
-		 * the name length - 1.
-		 * That will cover corner cases and will not evaluate
-		 * erroneously positive too many times...
-		 */
-		if (rlen < idev_len - 1)
+	while ((de = readdir(dir)) != NULL) {
+		if (sscanf(de->d_name, "event%d", evtno) != 1)
 			continue;
 
-		rc = strncmp(buf, idev_name, idev_len - 1);
-		if (rc == 0) {
-			close(fd);
+		fd = ucomm_open_inputdev(de->d_name, idev_name);
+		if (fd >= 0)
+			break;
+	}
 
-			rc = ucomm_tof_sys_init(VL53L0_HIGH_ACCURACY, i, plen);
-			if (rc < 0)
-				goto end;
+	closedir(dir);
 
-			return i;
-		}
+	return fd < 0 ? -ENODEV : fd;
+}
+
+/* Most events drained from the ToF device per read() */
+#define TOF_EVT_BATCH		64
+
+/* Updates a sample being assembled with a ranging event */
+static void ucomm_tof_abs_event(struct micro_communicator_vl53l0 *cur,
+			uint16_t code, int32_t value)
+{
+	switch (code) {
+	case ABS_DISTANCE:
+		if (value < 900 && value >= 0)
+			cur->distance = value;
+		break;
+	case ABS_HAT1X:
+		if (value < 9000 && value >= 0)
+			cur->range_mm = value;
+		break;
+	case ABS_HAT1Y:
+		cur->range_status = value;
+		break;
+	default:
+		break;
 	}
-end:
-	return rc;
 }
 
-/* TODO: Move me to background thread!! */
-int ucomm_input_tof_read(struct micro_communicator_vl53l0 *stmvl_cur,
-			uint16_t want_code)
+/*
+ * ucomm_tof_resync - Gets the current ranging values out of the
+ *		      device: evdev does not report values that did not
+ *		      change, nor the ones lost in a SYN_DROPPED.
+ */
+static void ucomm_tof_resync(int fd)
 {
-	struct input_event evt[64];
-	int retry = 0, i, len, rc;
-	bool rd, rr, rs, out;
-	uint16_t type, code;
-	int32_t value;
+	static const uint16_t codes[] = {
+		ABS_DISTANCE, ABS_HAT1X, ABS_HAT1Y
+	};
+	struct input_absinfo absinfo;
+	unsigned int i;
 
-	if (stmvl_fd < 0)
-		return -1;
+	for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+		if (ioctl(fd, EVIOCGABS(codes[i]), &absinfo) == 0)
+			ucomm_tof_abs_event(&tof_cur, codes[i], absinfo.value);
+	}
+}
 
-	stmvl_cur->range_status = 0;
+/* Makes a complete sample visible to the readers, all at once */
+static void ucomm_tof_publish(const struct micro_communicator_vl53l0 *sample)
+{
+	uint32_t id = tof_ring_head + 1;
+	int slot;
 
-again:
-	rd = false;
-	rr = false;
-	rs = false;
+	/* Zero means no sample */
+	if (id == 0)
+		id++;
+	slot = id % TOF_RING_SIZE;
+
+	ucomm_seqlock_write_begin(&tof_ring[slot].seq);
+	tof_ring[slot].id = id;
+	tof_ring[slot].sample = *sample;
+	ucomm_seqlock_write_end(&tof_ring[slot].seq);
+
+	__atomic_store_n(&tof_ring_head, id, __ATOMIC_RELEASE);
+}
+
+/*
+ * ucomm_tof_ring_read - Gets a consistent copy of a buffered sample.
+ *
+ * \return Returns true if the sample is still in the ring.
+ */
+static bool ucomm_tof_ring_read(uint32_t id,
+			struct micro_communicator_vl53l0 *sample)
+{
+	int slot = id % TOF_RING_SIZE;
+	uint32_t seq, cur_id;
 
 	do {
-		fsync(stmvl_fd);
+		seq = ucomm_seqlock_read_begin(&tof_ring[slot].seq);
+		cur_id = tof_ring[slot].id;
+		*sample = tof_ring[slot].sample;
+	} while (ucomm_seqlock_read_retry(&tof_ring[slot].seq, seq));
 
-		rc = read(stmvl_fd, &evt, sizeof(evt));
-		if (!rc) {
-			return rc;
-		}
+	return cur_id == id;
+}
 
-		len = rc / sizeof(struct input_event);
+/* Current time, in the same clock as the samples timestamps */
+int64_t ucomm_tof_now_us(void)
+{
+	struct timespec ts;
 
-		for (i = 0; i < len; i++) {
-			type = evt[i].type;
-			code = evt[i].code;
-			value = evt[i].value;
+	clock_gettime(__atomic_load_n(&tof_clock, __ATOMIC_ACQUIRE), &ts);
 
-			if (type != EV_ABS)
-				continue;
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-			switch (code)
-			{
-				case ABS_DISTANCE:
-					if (value < 900 && value >= 0) {
-						stmvl_cur->distance = value;
-						rd = true;
-					}
-					break;
-				case ABS_HAT1X:
-					if (value < 9000 && value >= 0) {
-						stmvl_cur->range_mm = value;
-						rr = true;
-					}
-					break;
-				case ABS_HAT1Y:
-					stmvl_cur->range_status = value;
-					rs = true;
-					break;
-				default:
-					break;
-			}
+/*
+ * ucomm_tof_get_window - Gets the latest buffered ToF samples,
+ *			  without ever blocking the ToF thread.
+ *
+ * \param samples - Output array, newest sample first
+ * \param max - Maximum number of samples to get
+ * \param max_age_ms - Skip samples older than this, zero for any
+ *
+ * \return Returns the number of samples copied.
+ */
+int ucomm_tof_get_window(struct micro_communicator_vl53l0 *samples,
+			int max, int max_age_ms)
+{
+	int64_t oldest_us = INT64_MIN;
+	uint32_t id;
+	int n = 0;
 
-			if ((rr && rd && rs) || (want_code == code))
-				goto done;
+	if (max > TOF_RING_SIZE)
+		max = TOF_RING_SIZE;
+
+	if (max_age_ms > 0)
+		oldest_us = ucomm_tof_now_us() - (int64_t)max_age_ms * 1000;
+
+	id = __atomic_load_n(&tof_ring_head, __ATOMIC_ACQUIRE);
+	for (; id != 0 && n < max; id--) {
+		/* Overwritten: the ToF thread lapped us */
+		if (!ucomm_tof_ring_read(id, &samples[n]))
+			break;
+
+		if (samples[n].stamp_us < oldest_us)
+			break;
+
+		n++;
+	}
+
+	return n;
+}
+
+/* Must be called with tof_wait_lock held */
+static bool __ucomm_tof_has_samples(int64_t since_us, int count)
+{
+	struct micro_communicator_vl53l0 win[TOF_RING_SIZE];
+	int n;
+
+	n = ucomm_tof_get_window(win, count, 0);
+
+	return n == count && win[n - 1].stamp_us > since_us;
+}
+
+/*
+ * ucomm_tof_wait_samples - Waits until the ToF thread has published
+ *			    some new samples.
+ *
+ * \param since_us - Only count samples newer than this timestamp,
+ *		     see ucomm_tof_now_us()
+ * \param count - Number of new samples to wait for
+ * \param timeout_ms - Maximum wait time, negative to wait forever
+ *
+ * \return Returns zero, -ETIMEDOUT or -ENODEV if the ToF thread
+ *	   is not running.
+ */
+int ucomm_tof_wait_samples(int64_t since_us, int count, int timeout_ms)
+{
+	struct timespec ts;
+	int rc = 0;
+
+	if (count < 1)
+		count = 1;
+	if (count > TOF_RING_SIZE)
+		return -EINVAL;
+
+	if (timeout_ms >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
 		}
-	} while (!rd || !rr || !rs);
+	}
 
-done:
-	if (stmvl_cur->range_status != 0) {
-		if (retry < 4) {
-			retry++;
-			goto again;
-		} else {
-			return -1;
+	pthread_mutex_lock(&tof_wait_lock);
+	while (!__ucomm_tof_has_samples(since_us, count)) {
+		if (!ucithread_run[THREAD_TOF]) {
+			rc = -ENODEV;
+			break;
+		}
+
+		if (rc == ETIMEDOUT) {
+			rc = -ETIMEDOUT;
+			break;
 		}
+
+		if (timeout_ms < 0)
+			rc = pthread_cond_wait(&tof_wait_cond, &tof_wait_lock);
+		else
+			rc = pthread_cond_timedwait(&tof_wait_cond,
+						&tof_wait_lock, &ts);
 	}
+	if (rc > 0)
+		rc = 0;
+	pthread_mutex_unlock(&tof_wait_lock);
 
-	return 0;
+	return rc;
 }
 
-int ucomm_input_tof_thr_read(struct micro_communicator_vl53l0 *stmvl_cur,
-			int tof_fd)
+static void ucomm_tof_wake_waiters(void)
 {
-	struct input_event evt[16];
-	int retry = 0, i, len, rc;
-	bool rd, rr, rs, out;
-	uint16_t type, code;
-	int32_t value;
+	pthread_mutex_lock(&tof_wait_lock);
+	pthread_cond_broadcast(&tof_wait_cond);
+	pthread_mutex_unlock(&tof_wait_lock);
+}
 
-	stmvl_cur->range_status = 0;
+/* Adds the process noise of a dt seconds prediction to p */
+static void ucomm_tof_kf_predict(float x[2], float p[2][2], float dt)
+{
+	float q = TOF_KF_ACCEL_VAR;
+	float dt2 = dt * dt;
 
-again:
-	rd = false;
-	rr = false;
-	rs = false;
+	x[0] += dt * x[1];
 
-	rc = read(tof_fd, &evt, sizeof(evt));
-	if (!rc) {
-		return rc;
+	p[0][0] += dt * (2 * p[0][1] + dt * p[1][1]) + q * dt2 * dt2 / 4;
+	p[0][1] += dt * p[1][1] + q * dt2 * dt / 2;
+	p[1][0] = p[0][1];
+	p[1][1] += q * dt2;
+}
+
+/*
+ * ucomm_tof_kf_update - Feeds a new sample to the range tracker and
+ *			 publishes the result. ToF thread only.
+ */
+static void ucomm_tof_kf_update(const struct micro_communicator_vl53l0 *s)
+{
+	float r, dt, y, sv, k0, k1, p01;
+
+	r = s->range_status == 0 ?
+		TOF_KF_MEAS_VAR_VALID : TOF_KF_MEAS_VAR_INVALID;
+	dt = (s->stamp_us - tof_kf.stamp_us) / 1000000.0f;
+
+	/* First sample, long gap or time going back: start over */
+	if (!tof_kf.valid || dt < 0 || dt * 1000 > TOF_KF_RESET_MS) {
+		tof_kf.x[0] = s->range_mm;
+		tof_kf.x[1] = 0;
+		tof_kf.p[0][0] = r;
+		tof_kf.p[0][1] = 0;
+		tof_kf.p[1][0] = 0;
+		tof_kf.p[1][1] = TOF_KF_ACCEL_VAR;
+		tof_kf.valid = true;
+		goto publish;
 	}
 
-	len = rc / sizeof(struct input_event);
+	ucomm_tof_kf_predict(tof_kf.x, tof_kf.p, dt);
 
-	for (i = 0; i < len; i++) {
-		type = evt[i].type;
-		code = evt[i].code;
-		value = evt[i].value;
+	y = s->range_mm - tof_kf.x[0];
+	sv = tof_kf.p[0][0] + r;
+	k0 = tof_kf.p[0][0] / sv;
+	k1 = tof_kf.p[0][1] / sv;
 
-		if (type != EV_ABS)
-			continue;
+	tof_kf.x[0] += k0 * y;
+	tof_kf.x[1] += k1 * y;
 
-		switch (code) {
-			case ABS_DISTANCE:
-				if (value < 900 && value >= 0) {
-					stmvl_cur->distance = value;
-					rd = true;
-				}
+	p01 = tof_kf.p[0][1];
+	tof_kf.p[0][0] -= k0 * tof_kf.p[0][0];
+	tof_kf.p[0][1] -= k0 * p01;
+	tof_kf.p[1][0] = tof_kf.p[0][1];
+	tof_kf.p[1][1] -= k1 * p01;
+
+publish:
+	tof_kf.stamp_us = s->stamp_us;
+
+	ucomm_seqlock_write_begin(&tof_track_pub.seq);
+	tof_track_pub.valid = true;
+	memcpy(tof_track_pub.x, tof_kf.x, sizeof(tof_kf.x));
+	memcpy(tof_track_pub.p, tof_kf.p, sizeof(tof_kf.p));
+	tof_track_pub.stamp_us = tof_kf.stamp_us;
+	ucomm_seqlock_write_end(&tof_track_pub.seq);
+}
+
+/*
+ * ucomm_tof_track_get - Gets the range tracked by the ToF thread,
+ *			 predicted to some time from now.
+ *
+ * \param trk - Output track
+ * \param horizon_ms - Prediction time from now, zero for the
+ *		       current estimate
+ *
+ * \return Returns zero or -ENODATA if no recent samples are tracked.
+ */
+int ucomm_tof_track_get(struct ucomm_tof_track *trk, int horizon_ms)
+{
+	float x[2], p[2][2];
+	int64_t stamp_us, now_us;
+	uint32_t seq;
+	bool valid;
+
+	do {
+		seq = ucomm_seqlock_read_begin(&tof_track_pub.seq);
+		valid = tof_track_pub.valid;
+		memcpy(x, tof_track_pub.x, sizeof(x));
+		memcpy(p, tof_track_pub.p, sizeof(p));
+		stamp_us = tof_track_pub.stamp_us;
+	} while (ucomm_seqlock_read_retry(&tof_track_pub.seq, seq));
+
+	now_us = ucomm_tof_now_us();
+	if (!valid || now_us - stamp_us > (int64_t)TOF_KF_RESET_MS * 1000)
+		return -ENODATA;
+
+	now_us += (int64_t)horizon_ms * 1000;
+	if (now_us > stamp_us)
+		ucomm_tof_kf_predict(x, p, (now_us - stamp_us) / 1000000.0f);
+
+	trk->range_mm = x[0];
+	trk->velocity = x[1];
+	trk->variance = p[0][0];
+	trk->stamp_us = now_us;
+
+	return 0;
+}
+
+/* Must be set before starting the ToF thread */
+void ucomm_tof_set_listener(ucomm_tof_listener_t listener)
+{
+	tof_listener = listener;
+}
+
+/* Hands a complete sample over to everybody. ToF thread only. */
+static void ucomm_tof_sample_done(const struct micro_communicator_vl53l0 *s)
+{
+	ucomm_tof_publish(s);
+	ucomm_tof_kf_update(s);
+	ucomm_state_set_tof(s->range_mm, s->range_status);
+
+	if (tof_listener)
+		tof_listener(s);
+}
+
+/*
+ * ucomm_tof_ingest - Drains the ToF device, assembling a sample out of
+ *		      the events of every SYN_REPORT, stamped with its
+ *		      kernel timestamp. Events of a report that spans
+ *		      two wakeups are kept for the next call.
+ *		      ToF thread only.
+ *
+ * \return Returns the number of samples published or negative errno.
+ */
+static int ucomm_tof_ingest(int fd)
+{
+	struct input_event evt[TOF_EVT_BATCH];
+	int i, len, rc, nsamples = 0;
+
+	for (;;) {
+		rc = read(fd, evt, sizeof(evt));
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				break;
-			case ABS_HAT1X:
-				if (value < 9000 && value >= 0) {
-					stmvl_cur->range_mm = value;
-					rr = true;
+			return -errno;
+		}
+
+		len = rc / sizeof(struct input_event);
+		if (len == 0)
+			break;
+
+		for (i = 0; i < len; i++) {
+			if (evt[i].type == EV_SYN &&
+			    evt[i].code == SYN_DROPPED) {
+				/* The buffer overran: skip to the next report */
+				tof_syn_dropped = true;
+				continue;
+			}
+
+			if (evt[i].type == EV_SYN &&
+			    evt[i].code == SYN_REPORT) {
+				if (tof_syn_dropped) {
+					tof_syn_dropped = false;
+					ucomm_tof_resync(fd);
+					continue;
 				}
-				break;
-			case ABS_HAT1Y:
-				stmvl_cur->range_status = value;
-				rs = true;
-				break;
-			default:
-				break;
+
+				tof_cur.stamp_us =
+					(int64_t)evt[i].time.tv_sec * 1000000 +
+					evt[i].time.tv_usec;
+				ucomm_tof_sample_done(&tof_cur);
+				nsamples++;
+				continue;
+			}
+
+			if (evt[i].type == EV_ABS && !tof_syn_dropped)
+				ucomm_tof_abs_event(&tof_cur, evt[i].code,
+						    evt[i].value);
 		}
+
+		/* Short read: nothing else is queued */
+		if (len < TOF_EVT_BATCH)
+			break;
 	}
 
-	return 0;
+	return nsamples;
 }
 
-static inline bool ucomm_tof_is_val_ok(int d1, int d2, int hysteresis)
+static inline int ucomm_tof_weight(const struct micro_communicator_vl53l0 *s)
 {
-	int max = d2 + hysteresis;
-	int min = d2 - hysteresis;
+	return s->range_status == 0 ? TOF_WEIGHT_VALID : TOF_WEIGHT_INVALID;
+}
 
-	if (d1 < max && d1 > min)
-		return true;
+/*
+ * ucomm_tof_estimate - Estimates the range out of the latest buffered
+ *			ToF samples, rejecting the outliers.
+ *
+ * The estimate is the mean of the samples falling within hyst of the
+ * weighted median, where samples with a bad range status weigh less.
+ * The confidence is the weight of these samples against the one of a
+ * full window of valid samples, so that short or noisy windows score
+ * lower.
+ *
+ * \param est - Output estimate
+ * \param nsamples - Window size, in samples
+ * \param max_age_ms - Skip samples older than this, zero for any
+ * \param hyst - Maximum distance from the median, in millimeters
+ *
+ * \return Returns the confidence or -ENODATA if there are no samples.
+ */
+int ucomm_tof_estimate(struct ucomm_tof_estimate *est,
+			int nsamples, int max_age_ms, int hyst)
+{
+	struct micro_communicator_vl53l0 win[TOF_RING_SIZE];
+	struct micro_communicator_vl53l0 tmp;
+	int n, i, j, w, total = 0, median = 0;
+	int in_w = 0, in_range = 0, in_dist = 0;
+
+	if (nsamples < 1)
+		nsamples = 1;
+	if (nsamples > TOF_RING_SIZE)
+		nsamples = TOF_RING_SIZE;
+	if (hyst < 0)
+		hyst = 0;
+
+	n = ucomm_tof_get_window(win, nsamples, max_age_ms);
+	if (n == 0)
+		return -ENODATA;
+
+	est->stamp_us = win[0].stamp_us;
+	est->nsamples = n;
+
+	/* Tiny window: insertion sort by range */
+	for (i = 1; i < n; i++) {
+		tmp = win[i];
+		for (j = i; j > 0 && win[j - 1].range_mm > tmp.range_mm; j--)
+			win[j] = win[j - 1];
+		win[j] = tmp;
+	}
 
-	return false;
+	for (i = 0; i < n; i++)
+		total += ucomm_tof_weight(&win[i]);
+
+	for (i = 0, w = 0; i < n; i++) {
+		w += ucomm_tof_weight(&win[i]);
+		if (w * 2 >= total) {
+			median = win[i].range_mm;
+			break;
+		}
+	}
+
+	/* Trimmed mean: only the samples around the median count */
+	for (i = 0; i < n; i++) {
+		if (win[i].range_mm < median - hyst ||
+		    win[i].range_mm > median + hyst)
+			continue;
+
+		w = ucomm_tof_weight(&win[i]);
+		in_w += w;
+		in_range += win[i].range_mm * w;
+		in_dist += win[i].distance * w;
+	}
+
+	est->range_mm = (in_range + in_w / 2) / in_w;
+	est->distance = (in_dist + in_w / 2) / in_w;
+	est->confidence = in_w * 100 / (nsamples * TOF_WEIGHT_VALID);
+
+	return est->confidence;
 }
 
 /*
- * ucomm_tof_thr_read_stabilized - Reads the ToF parameters and tries to
- *			       give back a value only if it is stable.
+ * ucomm_tof_read_estimate - Gets a range estimate out of the buffered
+ *			     ToF samples, waiting for new ones while the
+ *			     confidence is too low.
  *
- * \param stmvl_final - Final structure with ToF values
- * \param runs - Maximum number of times to read the ToF
- * \param nmatch - Number of times to match readings
- * \param sleep_ms - Delay between each read
- * \param hyst - Hysteresis, relative to the distance measurements
+ * \param est - Output estimate
+ * \param nsamples - Window size, in samples
+ * \param min_conf - Stop waiting as soon as this confidence is reached
+ * \param hyst - Maximum distance from the median, in millimeters
+ * \param timeout_ms - Maximum wait time for new samples
  *
- * \return Returns reliability of the measurement or -INT_MAX for error;
+ * \return Returns the confidence of the last estimate or negative errno.
  */
-int ucomm_tof_thr_read_stabilized(
-	struct micro_communicator_vl53l0 *stmvl_final,
-	int runs, int nmatch, int sleep_ms, int hyst)
+int ucomm_tof_read_estimate(struct ucomm_tof_estimate *est,
+			int nsamples, int min_conf, int hyst, int timeout_ms)
 {
-	int rc, retry = 0, cur_dst, range, score, i;
+	int64_t since_us, deadline_us;
+	int conf, rc;
 
 	/* Thread not running, we'd read nothing good here! */
 	if (!ucithread_run[THREAD_TOF])
-		return -1;
+		return -ENODEV;
 
 	/* Sensor is disabled, what are we trying to read?! */
-	if (!tof_enabled)
-		return -1;
+	if (!__atomic_load_n(&tof_enabled, __ATOMIC_ACQUIRE))
+		return -ENODEV;
 
-	/* Did we get called by someone who didn't read the docs? */
-	if (runs < nmatch)
-		runs = nmatch + 1;
+	deadline_us = ucomm_tof_now_us() + (int64_t)timeout_ms * 1000;
 
-again:
-	score = 0;
-	cur_dst = stmvl_status.distance;
-	range = stmvl_status.range_mm;
+	for (;;) {
+		conf = ucomm_tof_estimate(est, nsamples,
+				TOF_STABILIZATION_WINDOW_MS, hyst);
+		if (conf >= min_conf)
+			break;
 
-	for (i = 0; i < runs; i++) {
-		usleep(sleep_ms*1000);
+		timeout_ms = (int)((deadline_us - ucomm_tof_now_us()) / 1000);
+		if (timeout_ms <= 0)
+			break;
 
-		if (ucomm_tof_is_val_ok(range, stmvl_status.range_mm, hyst))
-			score++;
+		/*
+		 * Wait for a sample newer than the ones already used or,
+		 * if all of them are stale, for one within the window:
+		 * the stale ones would end the wait right away.
+		 */
+		if (conf < 0)
+			since_us = ucomm_tof_now_us() -
+				(int64_t)TOF_STABILIZATION_WINDOW_MS * 1000;
 		else
-			score--;
-	}
+			since_us = est->stamp_us;
 
-	/* Readings are very unstable! */
-	if (score < 0 && retry < 4) {
-		retry++;
-		goto again;
+		rc = ucomm_tof_wait_samples(since_us, 1, timeout_ms);
+		if (rc == -ENODEV)
+			return rc;
 	}
 
-	stmvl_final->distance = cur_dst;
-	stmvl_final->range_mm = range;
-
-	return score;
+	return conf;
 }
 
 /*
- * ucomm_tof_read_stabilized - Reads the ToF parameters and tries to
- *			       give back a value only if it is stable.
- *
- * \param stmvl_final - Final structure with ToF values
- * \param runs - Maximum number of times to read the ToF
- * \param nmatch - Number of times to match readings
- * \param sleep_ms - Delay between each read
- * \param hyst - Hysteresis, relative to the distance measurements
+ * ucomm_tof_attach - Starts using a newly found ToF sensor.
  *
- * \return Returns reliability of the measurement or -INT_MAX for error;
+ * \return Returns zero or negative errno.
  */
-int ucomm_tof_read_stabilized(
-	struct micro_communicator_vl53l0 *stmvl_final,
-	int runs, int nmatch, int sleep_ms, int hyst)
+static int ucomm_tof_attach(int fd, int evtno)
 {
-	struct micro_communicator_vl53l0 stmvl_cur;
-	int rc, retry = 0, cur_dst, range, score = 0, i;
+	struct epoll_event ev;
+	int clockid, rc;
 
-	/* Did we get called by someone who didn't read the docs? */
-	if (runs < nmatch)
-		runs = nmatch + 1;
+	rc = ucomm_tof_sys_init(true, evtno);
+	if (rc < 0)
+		goto err;
 
-again:
-	rc = ucomm_input_tof_read(&stmvl_cur, ABS_HAT1X);
-	if (rc < 0) {
-		ALOGE("ToF read failed");
-		//return -INT_MAX;
-	}
+	/* Timestamp the samples with the same clock used to age them */
+	clockid = CLOCK_MONOTONIC;
+	if (ioctl(fd, EVIOCSCLOCKID, &clockid) == 0)
+		__atomic_store_n(&tof_clock, clockid, __ATOMIC_RELEASE);
+	else
+		ALOGW("Cannot use monotonic ToF timestamps");
 
-	cur_dst = stmvl_cur.distance;
-	range = stmvl_cur.range_mm;
+	uci_pfds[FD_TOF].fd = fd;
+	uci_pfds[FD_TOF].events = POLLIN;
 
-	/* First run done before looping! */
-	for (i = 0; i < runs; i++) {
-		usleep(sleep_ms*1000);
-		rc = ucomm_input_tof_read(&stmvl_cur, ABS_HAT1X);
-		if (rc < 0)
-			continue;
-		if (ucomm_tof_is_val_ok(cur_dst, stmvl_cur.distance, hyst))
-			score++;
-		else
-			score--;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	rc = epoll_ctl(uci_pollfd[FD_TOF], EPOLL_CTL_ADD, fd, &ev);
+	if (rc) {
+		ALOGE("Cannot add epoll control");
+		rc = -errno;
+		goto err;
 	}
+	uci_pollevt[FD_TOF] = ev;
 
-	/* Readings are very unstable! */
-	if (score < 0 && retry < 4) {
-		retry++;
-		goto again;
-	}
+	stmvl_fd = fd;
+	stmvl_evtno = evtno;
 
-	stmvl_final->distance = cur_dst;
-	stmvl_final->range_mm = range;
+	memset(&tof_cur, 0, sizeof(tof_cur));
+	tof_syn_dropped = false;
+	ucomm_tof_resync(fd);
 
-	return score;
+	/*
+	 * Hotplugged: the ToF thread is already running, and must not
+	 * stall while the sensor settles. Samples just come in later.
+	 */
+	if (ucithread_run[THREAD_TOF])
+		__ucomm_tof_enable(true);
+
+	ALOGI("ToF sensor attached");
+
+	return 0;
+err:
+	pthread_mutex_lock(&tof_wait_lock);
+	uci_tof_enable_path[0] = '\0';
+	pthread_mutex_unlock(&tof_wait_lock);
+	close(fd);
+
+	return rc;
+}
+
+/* Stops using a ToF sensor that went away. ToF thread only. */
+static void ucomm_tof_detach(void)
+{
+	if (stmvl_fd < 0)
+		return;
+
+	epoll_ctl(uci_pollfd[FD_TOF], EPOLL_CTL_DEL, stmvl_fd, NULL);
+	close(stmvl_fd);
+	stmvl_fd = -1;
+	stmvl_evtno = -1;
+	uci_pollevt[FD_TOF].data.fd = -1;
+
+	pthread_mutex_lock(&tof_wait_lock);
+	uci_tof_enable_path[0] = '\0';
+	pthread_mutex_unlock(&tof_wait_lock);
+	__atomic_store_n(&tof_enabled, false, __ATOMIC_RELEASE);
+
+	ALOGW("ToF sensor detached");
+}
+
+/*
+ * ucomm_tof_hotplug - Handles the event nodes appearing and going
+ *		       away. ToF thread only.
+ */
+static void ucomm_tof_hotplug(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ie;
+	int len, off, evtno, fd;
+
+	while ((len = read(inotof_fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < len; off += sizeof(*ie) + ie->len) {
+			ie = (const struct inotify_event *)&buf[off];
+
+			if (ie->len == 0 ||
+			    sscanf(ie->name, "event%d", &evtno) != 1)
+				continue;
+
+			if (ie->mask & IN_DELETE) {
+				if (evtno == stmvl_evtno)
+					ucomm_tof_detach();
+				continue;
+			}
+
+			if (stmvl_fd >= 0)
+				continue;
+
+			/*
+			 * Tried again on IN_ATTRIB: ueventd may still be
+			 * fixing up the node permissions on IN_CREATE.
+			 */
+			fd = ucomm_open_inputdev(ie->name, VL53L0_STR);
+			if (fd >= 0)
+				ucomm_tof_attach(fd, evtno);
+		}
+	}
 }
 
 static void *ucomm_input_tof_thread(void *unusedvar UNUSED)
 {
-	int ret;
+	int ret, nev;
 	int i;
 	struct epoll_event pevt[10];
 
@@ -538,17 +1034,34 @@ static void *ucomm_input_tof_thread(void *unusedvar UNUSED)
 	ALOGD("ToF Thread started");
 
 	while (ucithread_run[THREAD_TOF]) {
-		ret = epoll_wait(uci_pollfd[FD_TOF], pevt,
+		nev = epoll_wait(uci_pollfd[FD_TOF], pevt,
 					10, uci_pfdelay_ms[FD_TOF]);
-		for (i = 0; i < ret; i++) {
-			if (pevt[i].events & EPOLLERR ||
-			    pevt[i].events & EPOLLHUP ||
-			    !(pevt[i].events & EPOLLIN))
+		for (i = 0; i < nev; i++) {
+			if (pevt[i].data.fd == inotof_fd) {
+				ucomm_tof_hotplug();
+				continue;
+			}
+
+			if (pevt[i].data.fd != stmvl_fd)
+				continue;
+
+			/* The sensor went away */
+			if (pevt[i].events & (EPOLLERR | EPOLLHUP)) {
+				ucomm_tof_detach();
+				continue;
+			}
+
+			if (!(pevt[i].events & EPOLLIN))
+				continue;
+
+			ret = ucomm_tof_ingest(stmvl_fd);
+			if (ret == -ENODEV) {
+				ucomm_tof_detach();
 				continue;
+			}
 
-			if (uci_pollevt[FD_TOF].data.fd)
-				ucomm_input_tof_thr_read(&stmvl_status,
-					uci_pollevt[FD_TOF].data.fd);
+			if (ret > 0)
+				ucomm_tof_wake_waiters();
 		}
 	}
 
@@ -564,6 +1077,8 @@ int ucomm_input_threadman(bool start, int threadno)
 
 	if (start == false) {
 		ucithread_run[threadno] = false;
+		if (threadno == THREAD_TOF)
+			ucomm_tof_wake_waiters();
 		return 0;
 	};
 
@@ -583,62 +1098,73 @@ int ucomm_input_threadman(bool start, int threadno)
 
 int ucomm_input_tof_init(void)
 {
-	int dlen, evtno, rc;
-	char *devname, *devpath;
-
-	dlen = strlen(VL53L0_STR);
-	devname = (char*) calloc(dlen, sizeof(char));
-	snprintf(devname, dlen, "%s", VL53L0_STR);
+	pthread_condattr_t cattr;
+	struct epoll_event ev;
+	int evtno, fd, rc;
 
-	evtno = ucomm_find_inputdev(ITERATE_MAX_DEVS, dlen, devname);
-	if (evtno < 0)
-		return -1;
-
-	dlen = strlen(devfs_input_str) + 3;
-	if (evtno > 9)
-		dlen++;
-
-	devpath = (char*) calloc(dlen, sizeof(char));
-	if (devpath == NULL)
-		return -1;
-
-	snprintf(devpath, dlen, "%s%d", devfs_input_str, evtno);
-
-
-	stmvl_fd = open(devpath, (O_RDONLY | O_NONBLOCK));
-	if (stmvl_fd < 0) {
-		ALOGE("Error: cannot open the %s input device at %s.",
-			devname, devpath);
-		return -1;
-	}
-
-	uci_pollfd[FD_TOF] = epoll_create1(0);
+	uci_pollfd[FD_TOF] = epoll_create1(EPOLL_CLOEXEC);
 	if (uci_pollfd[FD_TOF] == -1) {
 		ALOGE("Error: Cannot create epoll descriptor");
 		return -1;
 	}
-
-	uci_pfds[FD_TOF].fd = stmvl_fd;
-	uci_pfds[FD_TOF].events = POLLIN;
 	uci_pfdelay_ms[FD_TOF] = 1000;
 
-	uci_pollevt[FD_TOF].events = POLLIN; // | EPOLLET;
-	uci_pollevt[FD_TOF].data.fd = stmvl_fd;
+	/* Watch before looking, not to miss a sensor showing up between */
+	inotof_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotof_fd >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.fd = inotof_fd;
+		if (inotify_add_watch(inotof_fd, DEVFS_INPUT_DIR,
+				IN_CREATE | IN_ATTRIB | IN_DELETE) < 0 ||
+		    epoll_ctl(uci_pollfd[FD_TOF], EPOLL_CTL_ADD,
+				inotof_fd, &ev) < 0) {
+			close(inotof_fd);
+			inotof_fd = -1;
+		}
+	}
+	if (inotof_fd < 0)
+		ALOGW("Cannot watch %s: no ToF hotplug", DEVFS_INPUT_DIR);
 
-	rc = epoll_ctl(uci_pollfd[FD_TOF], EPOLL_CTL_ADD,
-					stmvl_fd, &uci_pollevt[FD_TOF]);
-	if (rc) {
-		ALOGE("Cannot add epoll control");
-		return -1;
+	fd = ucomm_find_inputdev(VL53L0_STR, &evtno);
+	if (fd >= 0) {
+		rc = ucomm_tof_attach(fd, evtno);
+		if (rc < 0)
+			goto err;
+	} else if (inotof_fd >= 0) {
+		ALOGI("Waiting for the %s to show up", VL53L0_STR);
+	} else {
+		ALOGE("Error: cannot find the %s input device.", VL53L0_STR);
+		rc = -1;
+		goto err;
 	}
 
 	ucithread_run[THREAD_TOF] = false;
 
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	rc = pthread_cond_init(&tof_wait_cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+	if (rc) {
+		ALOGE("Cannot initialize the ToF wait condition");
+		rc = -1;
+		goto err;
+	}
+
 	rc = ucomm_input_threadman(true, THREAD_TOF);
 	if (rc < 0)
-		return rc;
+		goto err;
 
 	return 0;
+err:
+	ucomm_tof_detach();
+	if (inotof_fd >= 0) {
+		close(inotof_fd);
+		inotof_fd = -1;
+	}
+	close(uci_pollfd[FD_TOF]);
+	uci_pollfd[FD_TOF] = -1;
+
+	return rc;
 }
 #else
 